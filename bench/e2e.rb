@@ -0,0 +1,283 @@
+# -*- encoding: binary -*-
+# usage: ruby -I lib bench/e2e.rb [OPTIONS] > results.jsonl
+#
+# Runs a minimal Rack app behind a tiny loopback HTTP/1.1 server, either
+# threaded (a thread per keep-alive connection) or preforking (a process
+# per connection, closed after each response like unicorn), and drives
+# it from forked clients.  Each configuration prints one JSON object
+# with requests/second and latency percentiles, first without Clogger,
+# then with each backend, :reentrant setting, Clogger::Format and sink.
+# Nothing outside the standard library (and rack) is needed, so results
+# from different releases can be compared line by line.
+require 'socket'
+require 'stringio'
+require 'json'
+require 'tempfile'
+require 'optparse'
+
+opts = {
+  :requests => 20000,
+  :clients => 4,
+  :workers => 4,
+  :servers => %w(threaded prefork),
+  :backends => %w(ext pure),
+  :reentrant => [ true, false ],
+  :formats => nil, # all of Clogger::Format
+  :sinks => %w(path logger),
+}
+OptionParser.new do |op|
+  op.on('-n', '--requests N', Integer, 'requests per configuration') { |n|
+    opts[:requests] = n
+  }
+  op.on('-c', '--clients N', Integer, 'client processes') { |n|
+    opts[:clients] = n
+  }
+  op.on('-w', '--workers N', Integer, 'prefork worker processes') { |n|
+    opts[:workers] = n
+  }
+  op.on('--servers LIST', Array, 'threaded,prefork') { |a| opts[:servers] = a }
+  op.on('--backends LIST', Array, 'ext,pure') { |a| opts[:backends] = a }
+  op.on('--reentrant LIST', Array, 'true,false') { |a|
+    opts[:reentrant] = a.map { |x| x == 'true' }
+  }
+  op.on('--formats LIST', Array, 'Clogger::Format names') { |a|
+    opts[:formats] = a
+  }
+  op.on('--sinks LIST', Array, 'path,logger') { |a| opts[:sinks] = a }
+end.parse!(ARGV)
+
+# reads one request off +io+, returns [ env, keepalive ] or nil at EOF
+def read_request(io)
+  line = io.gets("\r\n") or return
+  method, uri, version = line.split(' ', 3)
+  path, query = uri.split('?', 2)
+  env = {
+    'REQUEST_METHOD' => method,
+    'PATH_INFO' => path,
+    'QUERY_STRING' => query || '',
+    'HTTP_VERSION' => version.chomp,
+    'SERVER_NAME' => '127.0.0.1',
+    'SERVER_PORT' => '0',
+    'SCRIPT_NAME' => '',
+    'REMOTE_ADDR' => '127.0.0.1',
+    'rack.url_scheme' => 'http',
+    'rack.errors' => $stderr,
+  }
+  while (line = io.gets("\r\n")) && line != "\r\n"
+    k, v = line.split(':', 2)
+    env["HTTP_#{k.upcase.tr('-', '_')}"] = v.strip
+  end
+  [ env, env['HTTP_CONNECTION'] != 'close' ]
+end
+
+def respond(io, app, env, keepalive)
+  env['rack.input'] = StringIO.new(''.b)
+  status, headers, body = begin
+    app.call(env)
+  rescue
+    [ 500, {}, [] ]
+  end
+  buf = "HTTP/1.1 #{status} X\r\n".b
+  len = 0
+  chunks = []
+  body.each { |x| chunks << x; len += x.bytesize }
+  body.close if body.respond_to?(:close)
+  headers.each { |k, v| k =~ /\Acontent-length\z/i or buf << "#{k}: #{v}\r\n" }
+  buf << "Content-Length: #{len}\r\n"
+  buf << (keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n")
+  chunks.each { |x| buf << x }
+  io.write(buf)
+rescue
+  # the app or Clogger blew up after headers, the client sees a reset
+  io.close unless io.closed?
+end
+
+def threaded(srv, app)
+  loop do
+    c = srv.accept
+    Thread.new(c) do |io|
+      io.setsockopt(:IPPROTO_TCP, :TCP_NODELAY, 1)
+      begin
+        while (req = read_request(io))
+          env, keepalive = req
+          env['rack.multithread'] = true
+          env['rack.multiprocess'] = false
+          respond(io, app, env, keepalive)
+          break if !keepalive || io.closed?
+        end
+      rescue SystemCallError, IOError
+      end
+      io.close unless io.closed?
+    end
+  end
+end
+
+def prefork(srv, app, workers)
+  pids = workers.times.map do
+    fork do
+      trap(:TERM) { exit!(0) }
+      loop do
+        io = srv.accept
+        if (req = read_request(io))
+          env = req[0]
+          env['rack.multithread'] = false
+          env['rack.multiprocess'] = true
+          respond(io, app, env, false)
+        end
+        io.close unless io.closed?
+      end
+    end
+  end
+  trap(:TERM) { Process.kill(:TERM, *pids); exit!(0) }
+  Process.waitall
+end
+
+# forks the server, loading Clogger (or not) in the child so each
+# backend starts from a clean process
+def start_server(srv, cfg, opts, log)
+  fork do
+    trap(:TERM) { exit!(0) }
+    app = lambda do |env|
+      [ 200, { 'Content-Type' => 'text/plain', 'Content-Length' => '2' },
+        [ 'ok' ] ]
+    end
+    if cfg[:backend]
+      ENV['CLOGGER_PURE'] = cfg[:backend] == 'pure' ? '1' : ''
+      require 'clogger'
+      sink = case cfg[:sink]
+      when 'path' then { :path => log }
+      when 'logger'
+        require 'logger'
+        { :logger => Logger.new(log) }
+      end
+      app = Clogger.new(app, sink.merge(:reentrant => cfg[:reentrant],
+                        :format => Clogger::Format.const_get(cfg[:format])))
+    end
+    case cfg[:server]
+    when 'threaded' then threaded(srv, app)
+    when 'prefork' then prefork(srv, app, opts[:workers])
+    end
+  end
+end
+
+# each client process writes its latencies (seconds, as doubles) and
+# error count to +wr+
+def client(port, nr, keepalive, wr)
+  lat = []
+  errors = 0
+  io = nil
+  req = "GET /hello?goodbye=true HTTP/1.1\r\nHost: 127.0.0.1\r\n" \
+        "User-Agent: clogger-e2e/1.0\r\nReferer: http://example.com/\r\n" \
+        "Connection: #{keepalive ? 'keep-alive' : 'close'}\r\n\r\n"
+  nr.times do
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    begin
+      io ||= TCPSocket.new('127.0.0.1', port).tap do |s|
+        s.setsockopt(:IPPROTO_TCP, :TCP_NODELAY, 1)
+      end
+      io.write(req)
+      status = io.gets("\r\n") or raise EOFError
+      len = 0
+      close = false
+      while (line = io.gets("\r\n")) && line != "\r\n"
+        len = line.split(':', 2)[1].to_i if line =~ /\Acontent-length:/i
+        close = true if line =~ /\Aconnection: *close/i
+      end
+      io.read(len) if len > 0
+      errors += 1 unless status.start_with?('HTTP/1.1 200 ')
+      if close
+        io.close
+        io = nil
+      end
+    rescue SystemCallError, IOError
+      errors += 1
+      io.close if io && !io.closed?
+      io = nil
+    end
+    lat << Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0
+  end
+  io.close if io
+  wr.write([ errors, *lat ].pack('E*'))
+  wr.close
+end
+
+def run(cfg, opts)
+  log = Tempfile.new('clogger-e2e')
+  srv = TCPServer.new('127.0.0.1', 0)
+  srv.listen(1024)
+  port = srv.addr[1]
+  server = start_server(srv, cfg, opts, log.path)
+  srv.close
+  keepalive = cfg[:server] == 'threaded'
+
+  # wait until the server has loaded everything and answers
+  begin
+    TCPSocket.new('127.0.0.1', port).close
+  rescue Errno::ECONNREFUSED
+    sleep 0.01
+    retry
+  end
+  client(port, 50, keepalive, File.open(File::NULL, 'w')) # warm up
+
+  per = opts[:requests] / opts[:clients]
+  t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  pids = []
+  pipes = opts[:clients].times.map do
+    rd, wr = IO.pipe
+    pids << fork do
+      rd.close
+      client(port, per, keepalive, wr)
+      exit!(0)
+    end
+    wr.close
+    rd
+  end
+  lat = []
+  errors = 0
+  pipes.each do |rd|
+    e, *l = rd.read.unpack('E*')
+    errors += e.to_i
+    lat.concat(l)
+    rd.close
+  end
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0
+  pids.each { |pid| Process.waitpid(pid) }
+  Process.kill(:TERM, server)
+  Process.waitpid(server) rescue nil
+  lat.sort!
+  pct = lambda { |p| lat.empty? ? 0 : lat[(lat.size - 1) * p / 100] * 1000 }
+  cfg.merge(
+    :requests => lat.size,
+    :errors => errors,
+    :req_per_sec => (lat.size / elapsed).round(1),
+    :p50_ms => pct[50].round(3),
+    :p99_ms => pct[99].round(3),
+    :max_ms => pct[100].round(3),
+    :log_bytes => File.size(log.path),
+    :ruby => RUBY_DESCRIPTION,
+  )
+ensure
+  log.close! if log
+end
+
+formats = opts[:formats] || begin
+  # read the names without loading a backend into this process
+  src = File.read(File.expand_path('../../lib/clogger/format.rb', __FILE__))
+  src.scan(/^\s+([A-Z]\w*) = /).flatten
+end
+
+$stdout.sync = true
+opts[:servers].each do |server|
+  puts JSON.generate(run({ :server => server, :backend => nil }, opts))
+  opts[:backends].each do |backend|
+    opts[:reentrant].each do |reentrant|
+      formats.each do |format|
+        opts[:sinks].each do |sink|
+          cfg = { :server => server, :backend => backend,
+                  :reentrant => reentrant, :format => format, :sink => sink }
+          puts JSON.generate(run(cfg, opts))
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,41 @@
+# -*- encoding: binary -*-
+# usage: ruby -I lib bench/threads.rb [REQUESTS_PER_THREAD] [THREADS...]
+#
+# logs Combined lines to a temporary file from several threads, with and
+# without :buffer, and prints requests/second for each thread count
+require 'clogger'
+require 'tempfile'
+require 'stringio'
+require 'benchmark'
+
+nr = (ARGV.shift || 20000).to_i
+threads = ARGV.empty? ? [ 1, 2, 4, 8, 16, 32 ] : ARGV.map(&:to_i)
+app = lambda { |env| [ 200, { 'Content-Length' => '0' }, [] ] }
+env = {
+  'REQUEST_METHOD' => 'GET',
+  'PATH_INFO' => '/hello',
+  'QUERY_STRING' => 'goodbye=true',
+  'HTTP_VERSION' => 'HTTP/1.1',
+  'REMOTE_ADDR' => '127.0.0.1',
+  'HTTP_USER_AGENT' => 'bench/1.0',
+  'rack.input' => StringIO.new,
+}.freeze
+
+printf("%-8s %7s %12s %12s\n", 'mode', 'threads', 'req/s', 'write_calls')
+[ [ 'write', {} ], [ 'buffer', { :buffer => true } ] ].each do |mode, opts|
+  threads.each do |n|
+    tmp = Tempfile.new('clogger-bench')
+    cl = Clogger.new(app, opts.merge(:format => :Combined, :path => tmp.path,
+                                     :reentrant => true))
+    before = cl.stats[:write_calls]
+    t = Benchmark.realtime do
+      n.times.map do
+        Thread.new { nr.times { cl.call(env.dup)[2].close } }
+      end.each(&:join)
+      cl.flush
+    end
+    printf("%-8s %7d %12.0f %12d\n", mode, n, n * nr / t,
+           cl.stats[:write_calls] - before)
+    tmp.close!
+  end
+end
@@ -60,3 +60,12 @@ static ssize_t my_write(int fd, const void *buf, size_t count)
 #  define nogvl_stat(path,buf) stat((path),(buf))
 #  define nogvl_write(fd,buf,buf) write((fd),(buf),(count))
 #endif /* !WITHOUT_GVL */
+
+/* true if the current fiber is non-blocking under a Fiber.scheduler */
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+/* Ruby 3.0+ */
+#  include <ruby/fiber/scheduler.h>
+#  define fiber_scheduler_p() (!NIL_P(rb_fiber_scheduler_current()))
+#else
+#  define fiber_scheduler_p() (0)
+#endif
@@ -0,0 +1,152 @@
+/*
+ * binary prefix trie of trusted proxy networks for $real_ip.
+ * IPv4 addresses are stored as IPv4-mapped IPv6 (::ffff:0:0/96)
+ * so one trie covers both families.  Built once at initialization
+ * and read-only afterwards, so reentrant copies may share it.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+struct cidr_node {
+	unsigned child[2]; /* 0: none (the root is never a child) */
+	int term; /* a trusted prefix ends here */
+};
+
+struct cidr_trie {
+	struct cidr_node *nodes;
+	unsigned len;
+	unsigned capa;
+};
+
+static void cidr_trie_free(void *ptr)
+{
+	struct cidr_trie *t = ptr;
+
+	xfree(t->nodes);
+	xfree(t);
+}
+
+static unsigned cidr_node_new(struct cidr_trie *t)
+{
+	if (t->len == t->capa) {
+		t->capa = t->capa ? t->capa * 2 : 64;
+		REALLOC_N(t->nodes, struct cidr_node, t->capa);
+	}
+	memset(&t->nodes[t->len], 0, sizeof(struct cidr_node));
+	return t->len++;
+}
+
+static inline int addr_bit(const unsigned char *addr, unsigned i)
+{
+	return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static void cidr_insert(struct cidr_trie *t, const unsigned char *addr,
+                        unsigned prefix)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < prefix; i++) {
+		int b = addr_bit(addr, i);
+
+		if (t->nodes[n].term)
+			return; /* a shorter prefix already covers this */
+		if (!t->nodes[n].child[b]) {
+			unsigned tmp = cidr_node_new(t);
+
+			t->nodes[n].child[b] = tmp;
+		}
+		n = t->nodes[n].child[b];
+	}
+	t->nodes[n].term = 1;
+}
+
+static int cidr_match(const struct cidr_trie *t, const unsigned char *addr)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < 128; i++) {
+		if (t->nodes[n].term)
+			return 1;
+		n = t->nodes[n].child[addr_bit(addr, i)];
+		if (n == 0)
+			return 0;
+	}
+	return t->nodes[n].term;
+}
+
+/*
+ * parses +len+ bytes at +ptr+ (not NUL-terminated) into a 16-byte
+ * IPv6 (or IPv4-mapped) address, surrounding spaces are ignored.
+ * Returns the address family or zero if unparseable.
+ */
+static int cidr_parse_addr(unsigned char *addr, const char *ptr, long len)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	while (len > 0 && *ptr == ' ') {
+		ptr++;
+		len--;
+	}
+	while (len > 0 && ptr[len - 1] == ' ')
+		len--;
+	if (len <= 0 || len >= (long)sizeof(buf))
+		return 0;
+	memcpy(buf, ptr, len);
+	buf[len] = '\0';
+
+	if (memchr(buf, ':', len))
+		return inet_pton(AF_INET6, buf, addr) == 1 ? AF_INET6 : 0;
+
+	if (inet_pton(AF_INET, buf, addr + 12) != 1)
+		return 0;
+	memset(addr, 0, 10);
+	addr[10] = addr[11] = 0xff;
+	return AF_INET;
+}
+
+/* compiles an Array of "ADDR[/PREFIX]" strings, raises on garbage */
+static VALUE cidr_trie_new(VALUE list)
+{
+	struct cidr_trie *t;
+	VALUE rv = Data_Make_Struct(0, struct cidr_trie,
+	                            NULL, cidr_trie_free, t);
+	long i;
+
+	list = rb_Array(list);
+	cidr_node_new(t); /* root */
+	for (i = 0; i < RARRAY_LEN(list); i++) {
+		VALUE str = rb_obj_as_string(rb_ary_entry(list, i));
+		const char *ptr = RSTRING_PTR(str);
+		const char *slash = memchr(ptr, '/', RSTRING_LEN(str));
+		long alen = slash ? slash - ptr : RSTRING_LEN(str);
+		unsigned char addr[16];
+		int family = cidr_parse_addr(addr, ptr, alen);
+		long prefix = family == AF_INET ? 32 : 128;
+
+		if (family && slash) {
+			char *end;
+
+			prefix = strtol(slash + 1, &end, 10);
+			if (end == slash + 1 || *end || prefix < 0 ||
+			    prefix > (family == AF_INET ? 32 : 128))
+				family = 0;
+		}
+		if (!family)
+			rb_raise(rb_eArgError, "invalid trusted proxy: %s",
+			         StringValueCStr(str));
+		if (family == AF_INET)
+			prefix += 96;
+		cidr_insert(t, addr, (unsigned)prefix);
+	}
+	return rv;
+}
+
+static struct cidr_trie *cidr_trie_get(VALUE obj)
+{
+	struct cidr_trie *t;
+
+	Data_Get_Struct(obj, struct cidr_trie, t);
+	return t;
+}
@@ -18,10 +18,23 @@
 #endif
 #include <time.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>		/* snprintf */
 #include "ruby_1_9_compat.h"
 #include "broken_system_compat.h"
 #include "blocking_helpers.h"
+#include "cidr_trie.h"
+#include "stats.h"
+#include "line_buffer.h"
+#include "log_file.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "request_id.h"
+#include "path_template.h"
+#include "escape.h"
+#include "flight_recorder.h"
+#include "parser.h"
+#include "probes.h"
 
 /*
  * Availability of a monotonic clock needs to be detected at runtime
@@ -81,7 +94,10 @@ enum clogger_opcode {
 	CL_OP_TIME_UTC,
 	CL_OP_REQUEST_TIME,
 	CL_OP_TIME,
-	CL_OP_COOKIE
+	CL_OP_COOKIE,
+	CL_OP_ARG,
+	CL_OP_CPU_TIME,
+	CL_OP_GC_TIME
 };
 
 enum clogger_special {
@@ -95,7 +111,32 @@ enum clogger_special {
 	CL_SP_request_uri,
 	CL_SP_time_iso8601,
 	CL_SP_time_local,
-	CL_SP_time_utc
+	CL_SP_time_utc,
+	CL_SP_real_ip,
+	CL_SP_gc_count,
+	CL_SP_allocated_objects,
+	CL_SP_repeat_count,
+	CL_SP_request_id,
+	CL_SP_path_template
+};
+
+#define FIELD_CACHE_SIZE 32
+
+struct fc_entry {
+	VALUE key; /* env/header/cookie/arg name or special var number */
+	int opcode;
+	long off; /* into field_cache.snap */
+	long len;
+};
+
+/*
+ * escaped values rendered once per request and shared by all :outputs,
+ * each reentrant copy gets its own like log_buf
+ */
+struct field_cache {
+	VALUE snap; /* backing store for ent */
+	int len;
+	struct fc_entry ent[FIELD_CACHE_SIZE];
 };
 
 struct clogger {
@@ -104,9 +145,35 @@ struct clogger {
 	VALUE fmt_ops;
 	VALUE logger;
 	VALUE log_buf;
+	VALUE trusted;
+	VALUE cond; /* :if callable, or nil */
+	VALUE outputs; /* Array of app-less Cloggers, or nil */
+	VALUE fcache; /* per-copy like log_buf, nil without :outputs */
+	struct field_cache *fc;
+	VALUE stats; /* shared with reentrant copies and :outputs */
+	struct clogger_stats *st;
+	VALUE lbuf; /* shared with reentrant copies, nil if unbuffered */
+	struct line_buffer *lb;
+	VALUE fbuf; /* for fibers, shared like lbuf, nil with lbuf or no fd */
+	struct line_buffer *fb;
+	VALUE logfile; /* shared with reentrant copies, nil without a fd */
+	struct log_file *lf;
+	VALUE dedup; /* shared with reentrant copies, nil without :dedup */
+	struct dedup *dd;
+	VALUE rid_env; /* env key for :request_id, or nil */
+	VALUE pathtpl; /* shared with reentrant copies */
+	struct path_tpl *pt;
+	VALUE flight; /* shared with reentrant copies, nil if unused */
+	struct flight_recorder *fr;
+	VALUE snapshot; /* per-copy like log_buf, nil without :snapshot */
+	struct snapshot *sn;
+	struct snapshot *capture; /* sn while capturing, otherwise NULL */
+	int use_snapshot;
+	int xs_utf8; /* :escape => :utf8 */
 
 	VALUE env;
 	VALUE cookies;
+	VALUE input;
 	VALUE status;
 	VALUE headers;
 	VALUE body;
@@ -114,10 +181,32 @@ struct clogger {
 	off_t body_bytes_sent;
 	struct timespec ts_start;
 
-	int fd;
+	/* resource usage snapshots, only taken if the format needs them */
+	struct timespec cpu_start;
+	size_t gc_count_start;
+	size_t gc_time_start;
+	size_t alloc_start;
+
 	int wrap_body;
 	int need_resp;
+	int need_input;
+	int need_cpu;
+	int need_gc;
+
+	long max_line; /* -1: unlimited, counts the trailing newline */
+	long line_left; /* bytes left before the line's tail (e.g. ORS) */
+	long field_left; /* bytes left for the current variable */
+	int line_cut;
+	int field_cut;
+	uint64_t line_hash; /* of everything but volatile_op()s, for :dedup */
+	long count_off; /* of $repeat_count in log_buf, -1 if absent */
+	long count_len;
 	int reentrant; /* tri-state, -1:auto, 1/0 true/false */
+	clockid_t mono_clock; /* for $request_time, maybe a _COARSE one */
+	clockid_t real_clock; /* for $time */
+
+	int rid_len; /* 0 until $request_id is picked for this request */
+	char rid[REQUEST_ID_MAX];
 };
 
 static ID write_id;
@@ -126,18 +215,28 @@ static ID call_id;
 static ID close_id;
 static ID to_i_id;
 static ID to_s_id;
-static ID size_id;
 static ID sq_brace_id;
 static ID new_id;
 static ID to_path_id;
 static ID respond_to_id;
+static ID bytes_read_id;
+static ID start_flusher_id;
+static ID flush_soon_id;
+static ID register_buffer_id;
+static ID rotate_later_id;
+static ID open_writer_id;
 static VALUE cClogger;
 static VALUE mFormat;
 static VALUE cHeaderHash;
+static VALUE cInputCounter;
+static VALUE cIndex;
 
 /* common hash lookup keys */
 static VALUE g_HTTP_X_FORWARDED_FOR;
+static VALUE g_HTTP_X_REQUEST_ID;
+static VALUE g_HTTP_COOKIE;
 static VALUE g_REMOTE_ADDR;
+static VALUE g_CONTENT_LENGTH;
 static VALUE g_REQUEST_METHOD;
 static VALUE g_PATH_INFO;
 static VALUE g_REQUEST_URI;
@@ -150,61 +249,164 @@ static VALUE g_dash;
 static VALUE g_space;
 static VALUE g_question_mark;
 static VALUE g_rack_request_cookie_hash;
+static VALUE sym_gc_time; /* Qfalse if GC.stat(:time) is unsupported */
+static VALUE sym_total_allocated_objects;
 
 #define LOG_BUF_INIT_SIZE 128
+#define LOG_BUF_SHRINK_SIZE 4096
+#define LINE_BUFFER_SIZE 65536 /* :buffer => true */
+
+static void field_cache_mark(void *ptr)
+{
+	struct field_cache *fc = ptr;
+
+	rb_gc_mark(fc->snap);
+}
+
+static VALUE field_cache_new(struct field_cache **fc)
+{
+	VALUE rv = Data_Make_Struct(0, struct field_cache, field_cache_mark,
+	                            RUBY_DEFAULT_FREE, *fc);
+
+	(*fc)->snap = rb_str_buf_new(LOG_BUF_INIT_SIZE);
+	return rv;
+}
 
 static void init_buffers(struct clogger *c)
 {
 	c->log_buf = rb_str_buf_new(LOG_BUF_INIT_SIZE);
+	c->fc = NULL;
+	c->fcache = NIL_P(c->outputs) ? Qnil : field_cache_new(&c->fc);
+	c->sn = NULL;
+	c->capture = NULL;
+	c->snapshot = c->use_snapshot ? snapshot_new(&c->sn) : Qnil;
+	if (c->sn)
+		c->sn->utf8 = c->xs_utf8;
 }
 
-static inline int need_escape(unsigned c)
+/*
+ * every byte of a log line goes through field_cat (directly or via
+ * field_xs), which enforces per-variable ($http_user_agent{256}) and
+ * per-line (:max_line_length) caps so hostile requests can't inflate
+ * our lines (and log_buf) at will.
+ */
+static void field_cat(struct clogger *c, const char *ptr, long len)
 {
-	assert(c <= 0xff);
-	return !!(c == '\'' || c == '"' || c <= 0x1f || c >= 0x7f);
+	if (c->capture) {
+		snap_put(c->capture, SNAP_RAW, 0, 0, 0, ptr, len);
+		return;
+	}
+	if (unlikely(len > c->field_left)) {
+		len = c->field_left;
+		c->field_cut = 1;
+	}
+	if (unlikely(len > c->line_left)) {
+		len = c->line_left;
+		c->line_cut = 1;
+	}
+	if (len > 0) {
+		c->field_left -= len;
+		c->line_left -= len;
+		rb_str_buf_cat(c->log_buf, ptr, len);
+	}
 }
 
-/* we are encoding-agnostic, clients can send us all sorts of junk */
-static VALUE byte_xs(VALUE obj)
+static void field_str(struct clogger *c, VALUE str)
 {
-	static const char esc[] = "0123456789ABCDEF";
-	unsigned char *new_ptr;
-	VALUE from = rb_obj_as_string(obj);
-	const unsigned char *ptr = (const unsigned char *)RSTRING_PTR(from);
-	long len = RSTRING_LEN(from);
-	long new_len = len;
-	VALUE rv;
+	field_cat(c, RSTRING_PTR(str), RSTRING_LEN(str));
+}
 
-	for (; --len >= 0; ptr++) {
-		unsigned c = *ptr;
+/*
+ * we are encoding-agnostic, clients can send us all sorts of junk.
+ * This escapes straight into log_buf without a temporary string.
+ */
+static void field_xs(struct clogger *c, const char *ptr, long len)
+{
+	const unsigned char *p = (const unsigned char *)ptr;
+	const unsigned char *end = p + len;
+	char x[4] = { '\\', 'x', 0, 0 };
 
-		if (unlikely(need_escape(c)))
-			new_len += 3; /* { '\', 'x', 'X', 'X' } */
+	if (c->capture) {
+		snap_put(c->capture, SNAP_XS, 0, 0, 0, ptr, len);
+		return;
 	}
+	while (p < end) {
+		long n = xs_run(p, end, c->xs_utf8);
+
+		if (n) {
+			field_cat(c, (const char *)p, n);
+			p += n;
+			if (p == end)
+				return;
+		}
+		x[2] = esc[*p >> 4];
+		x[3] = esc[*p & 0xf];
+		field_cat(c, x, sizeof(x));
+		if (unlikely(c->field_cut || c->line_cut))
+			return;
+		p++;
+	}
+}
 
-	len = RSTRING_LEN(from);
-	if (new_len == len)
-		return from;
+static void field_xs_str(struct clogger *c, VALUE obj)
+{
+	VALUE str = rb_obj_as_string(obj);
+
+	field_xs(c, RSTRING_PTR(str), RSTRING_LEN(str));
+	RB_GC_GUARD(str);
+}
 
-	rv = rb_str_new(NULL, new_len);
-	new_ptr = (unsigned char *)RSTRING_PTR(rv);
-	ptr = (const unsigned char *)RSTRING_PTR(from);
-	for (; --len >= 0; ptr++) {
-		unsigned c = *ptr;
+#define TRUNC_MARK "..."
+#define TRUNC_MARK_LEN (sizeof(TRUNC_MARK) - 1)
 
-		if (unlikely(need_escape(c))) {
-			*new_ptr++ = '\\';
-			*new_ptr++ = 'x';
-			*new_ptr++ = esc[c >> 4];
-			*new_ptr++ = esc[c & 0xf];
-		} else {
-			*new_ptr++ = c;
+/*
+ * don't leave half of a "\xXX" escape (or, with :escape => :utf8,
+ * of a character) behind after truncating
+ */
+static void trim_escape(VALUE buf, long floor, int utf8)
+{
+	const char *p = RSTRING_PTR(buf);
+	long n = RSTRING_LEN(buf);
+
+	if (n - 1 >= floor && p[n - 1] == '\\')
+		n -= 1;
+	else if (n - 2 >= floor && p[n - 2] == '\\' && p[n - 1] == 'x')
+		n -= 2;
+	else if (n - 3 >= floor && p[n - 3] == '\\' && p[n - 2] == 'x')
+		n -= 3;
+	else if (utf8)
+		n = utf8_trim(p, n, floor);
+	rb_str_set_len(buf, n);
+}
+
+/* decodes "+" and "%XX" like Rack::Utils.unescape, then escapes it */
+static void unescape_xs(struct clogger *c, const char *p, long len)
+{
+	char buf[256];
+	long n = 0;
+
+	for (; len > 0; len--, p++) {
+		int ch = *p;
+
+		if (ch == '+') {
+			ch = ' ';
+		} else if (ch == '%' && len > 2) {
+			int hi = hexval(p[1]);
+			int lo = hexval(p[2]);
+
+			if (hi >= 0 && lo >= 0) {
+				ch = (hi << 4) | lo;
+				p += 2;
+				len -= 2;
+			}
+		}
+		buf[n++] = (char)ch;
+		if (n == sizeof(buf)) {
+			field_xs(c, buf, n);
+			n = 0;
 		}
 	}
-	assert(RSTRING_PTR(rv)[RSTRING_LEN(rv)] == '\0');
-
-	RB_GC_GUARD(from);
-	return rv;
+	field_xs(c, buf, n);
 }
 
 static void clogger_mark(void *ptr)
@@ -215,8 +417,22 @@ static void clogger_mark(void *ptr)
 	rb_gc_mark(c->fmt_ops);
 	rb_gc_mark(c->logger);
 	rb_gc_mark(c->log_buf);
+	rb_gc_mark(c->trusted);
+	rb_gc_mark(c->cond);
+	rb_gc_mark(c->outputs);
+	rb_gc_mark(c->fcache);
+	rb_gc_mark(c->stats);
+	rb_gc_mark(c->lbuf);
+	rb_gc_mark(c->fbuf);
+	rb_gc_mark(c->logfile);
+	rb_gc_mark(c->dedup);
+	rb_gc_mark(c->rid_env);
+	rb_gc_mark(c->pathtpl);
+	rb_gc_mark(c->flight);
+	rb_gc_mark(c->snapshot);
 	rb_gc_mark(c->env);
 	rb_gc_mark(c->cookies);
+	rb_gc_mark(c->input);
 	rb_gc_mark(c->status);
 	rb_gc_mark(c->headers);
 	rb_gc_mark(c->body);
@@ -239,21 +455,27 @@ static struct clogger *clogger_get(VALUE self)
 }
 
 /* only for writing to regular files, not stupid crap like NFS  */
-static void write_full(int fd, const char *buf, size_t count)
+static void
+write_full(struct clogger_stats *st, int fd, const char *buf, size_t count)
 {
 	ssize_t r;
 
 	while (count > 0) {
 		r = nogvl_write(fd, buf, count);
+		STAT_ADD(st, write_calls, 1);
 
 		if ((size_t)r == count) { /* overwhelmingly likely */
 			return;
 		} else if (r > 0) {
+			STAT_ADD(st, short_writes, 1);
 			count -= r;
 			buf += r;
 		} else {
-			if (errno == EINTR || errno == EAGAIN)
-				continue; /* poor souls on NFS and like: */
+			if (errno == EINTR || errno == EAGAIN) {
+				/* poor souls on NFS and like: */
+				STAT_ADD(st, write_retries, 1);
+				continue;
+			}
 			if (!errno)
 				errno = ENOSPC;
 			rb_sys_fail("write");
@@ -265,6 +487,113 @@ static void write_full(int fd, const char *buf, size_t count)
  * allow us to use write_full() iff we detect a blocking file
  * descriptor that wouldn't play nicely with Ruby threading/fibers
  */
+struct lf_write_args {
+	struct clogger_stats *st;
+	struct log_fd *f;
+	const char *ptr;
+	size_t len;
+};
+
+static VALUE lf_write_i(VALUE p)
+{
+	struct lf_write_args *a = (struct lf_write_args *)p;
+
+	write_full(a->st, a->f->fd, a->ptr, a->len);
+	return Qnil;
+}
+
+static VALUE lf_write_done(VALUE p)
+{
+	struct lf_write_args *a = (struct lf_write_args *)p;
+
+	log_fd_put(a->f);
+	return Qnil;
+}
+
+/* sticks to whichever descriptor is current when we start */
+static void lf_write(struct clogger_stats *st, struct log_file *lf,
+                     const char *ptr, size_t len)
+{
+	struct lf_write_args a;
+
+	a.st = st;
+	a.f = log_fd_get(lf);
+	a.ptr = ptr;
+	a.len = len;
+	rb_ensure(lf_write_i, (VALUE)&a, lf_write_done, (VALUE)&a);
+	lf->size += len;
+}
+
+struct flush_args {
+	struct clogger_stats *st;
+	struct line_buffer *lb;
+	struct log_file *lf;
+	char *ptr;
+	size_t len;
+	size_t capa;
+};
+
+static VALUE flush_write(VALUE p)
+{
+	struct flush_args *a = (struct flush_args *)p;
+
+	lf_write(a->st, a->lf, a->ptr, a->len);
+	return Qnil;
+}
+
+static VALUE flush_done(VALUE p)
+{
+	struct flush_args *a = (struct flush_args *)p;
+
+	a->lb->spare = a->ptr;
+	a->lb->spare_capa = a->capa;
+	a->lb->flushing = 0;
+	return Qnil;
+}
+
+/*
+ * writes out everything pending in +lb+.  Appends keep going into the
+ * spare buffer while we're in write(2) without the GVL.  If another
+ * thread is already flushing, we either leave it to them or (+wait+)
+ * wait for them and flush whatever was appended in the meantime.
+ * Their write(2) may be stuck on a slow disk, so we sleep rather than
+ * spin while waiting, backing off from 100us to ~10ms.
+ */
+static void lb_flush(struct clogger_stats *st, struct log_file *lf,
+                     struct line_buffer *lb, int wait)
+{
+	struct flush_args a;
+	struct timespec now;
+	struct timeval nap = { 0, 100 };
+
+	while (lb->flushing) {
+		if (!wait)
+			return;
+		rb_thread_wait_for(nap);
+		if (nap.tv_usec < 10000)
+			nap.tv_usec *= 2;
+	}
+	if (lb->len == 0 || lb->pid != getpid())
+		return;
+
+	a.st = st;
+	a.lb = lb;
+	a.lf = lf;
+	a.ptr = lb->ptr;
+	a.len = lb->len;
+	a.capa = lb->capa;
+	lb->ptr = lb->spare;
+	lb->capa = lb->spare_capa;
+	lb->len = 0;
+	lb->spare = NULL;
+	lb->spare_capa = 0;
+	lb->flushing = 1;
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	line_buffer_arm(lb, &now);
+
+	rb_ensure(flush_write, (VALUE)&a, flush_done, (VALUE)&a);
+}
+
 static int raw_fd(VALUE my_fd)
 {
 #if defined(HAVE_FCNTL) && defined(F_GETFL) && defined(O_NONBLOCK)
@@ -317,7 +646,7 @@ static void append_status(struct clogger *c)
 		status = rb_funcall(status, to_i_id, 0);
 		/* no way it's a valid status code (at least not HTTP/1.1) */
 		if (TYPE(status) != T_FIXNUM) {
-			rb_str_buf_append(c->log_buf, g_dash);
+			field_str(c, g_dash);
 			return;
 		}
 	}
@@ -326,10 +655,10 @@ static void append_status(struct clogger *c)
 	if (nr >= 100 && nr <= 999) {
 		nr = snprintf(buf, sizeof(buf), "%03d", nr);
 		assert(nr == 3);
-		rb_str_buf_cat(c->log_buf, buf, nr);
+		field_cat(c, buf, nr);
 	} else {
 		/* raise?, swap for 500? */
-		rb_str_buf_append(c->log_buf, g_dash);
+		field_str(c, g_dash);
 	}
 }
 
@@ -342,12 +671,70 @@ static void append_ip(struct clogger *c)
 	if (NIL_P(tmp)) {
 		/* can't be faked on any real server, so no escape */
 		tmp = rb_hash_aref(env, g_REMOTE_ADDR);
-		if (NIL_P(tmp))
-			tmp = g_dash;
+		field_str(c, NIL_P(tmp) ? g_dash : tmp);
 	} else {
-		tmp = byte_xs(tmp);
+		field_xs_str(c, tmp);
+	}
+}
+
+static void append_remote_addr(struct clogger *c, VALUE remote)
+{
+	/* can't be faked on any real server, so no escape */
+	field_str(c, NIL_P(remote) ? g_dash : remote);
+}
+
+/*
+ * $real_ip: walk X-Forwarded-For right-to-left and log the first
+ * address which isn't one of our trusted proxies.  Nothing is
+ * trusted unless it came through a trusted proxy (REMOTE_ADDR).
+ */
+static void append_real_ip(struct clogger *c)
+{
+	VALUE remote = rb_hash_aref(c->env, g_REMOTE_ADDR);
+	VALUE xff;
+	struct cidr_trie *t;
+	unsigned char addr[16];
+	const char *beg, *p;
+
+	if (NIL_P(c->trusted) || TYPE(remote) != T_STRING)
+		goto out;
+	t = cidr_trie_get(c->trusted);
+	if (!cidr_parse_addr(addr, RSTRING_PTR(remote), RSTRING_LEN(remote))
+	    || !cidr_match(t, addr))
+		goto out;
+
+	xff = rb_hash_aref(c->env, g_HTTP_X_FORWARDED_FOR);
+	if (TYPE(xff) != T_STRING)
+		goto out;
+
+	beg = RSTRING_PTR(xff);
+	p = beg + RSTRING_LEN(xff);
+	while (p > beg) {
+		const char *end = p;
+		long len;
+
+		while (p > beg && p[-1] != ',')
+			p--;
+		len = end - p;
+		if (!cidr_parse_addr(addr, p, len) || !cidr_match(t, addr)) {
+			while (len > 0 && *p == ' ') {
+				p++;
+				len--;
+			}
+			while (len > 0 && p[len - 1] == ' ')
+				len--;
+			if (len > 0) {
+				field_xs(c, p, len);
+				RB_GC_GUARD(xff);
+				return;
+			}
+		}
+		if (p > beg)
+			p--; /* skip ',' */
 	}
-	rb_str_buf_append(c->log_buf, tmp);
+	RB_GC_GUARD(xff);
+out:
+	append_remote_addr(c, remote);
 }
 
 static void append_body_bytes_sent(struct clogger *c)
@@ -357,7 +744,7 @@ static void append_body_bytes_sent(struct clogger *c)
 	int nr = snprintf(buf, sizeof(buf), fmt, c->body_bytes_sent);
 
 	assert(nr > 0 && nr < (int)sizeof(buf));
-	rb_str_buf_cat(c->log_buf, buf, nr);
+	field_cat(c, buf, nr);
 }
 
 static void append_ts(struct clogger *c, VALUE op, struct timespec *ts)
@@ -371,25 +758,68 @@ static void append_ts(struct clogger *c, VALUE op, struct timespec *ts)
 	nr = snprintf(buf, sizeof(buf), fmt,
 		      (int)ts->tv_sec, (int)(usec / ndiv));
 	assert(nr > 0 && nr < (int)sizeof(buf));
-	rb_str_buf_cat(c->log_buf, buf, nr);
+	field_cat(c, buf, nr);
 }
 
 static void append_request_time_fmt(struct clogger *c, VALUE op)
 {
 	struct timespec now;
 
-	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	clock_gettime(c->mono_clock, &now);
 	clock_diff(&now, &c->ts_start);
 	append_ts(c, op, &now);
 }
 
+/*
+ * CPU time of the thread running the request, unlike $request_time
+ * this excludes GVL waits and slow clients
+ */
+static void append_cpu_time_fmt(struct clogger *c, VALUE op)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) {
+		clock_diff(&now, &c->cpu_start);
+		append_ts(c, op, &now);
+		return;
+	}
+#endif
+	field_str(c, g_dash);
+}
+
+/* GC.stat(:time) is in milliseconds (Ruby 3.1+) and process-wide */
+static void append_gc_time_fmt(struct clogger *c, VALUE op)
+{
+	struct timespec ts;
+	size_t ms;
+
+	if (sym_gc_time == Qfalse) {
+		field_str(c, g_dash);
+		return;
+	}
+	ms = rb_gc_stat(sym_gc_time) - c->gc_time_start;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	append_ts(c, op, &ts);
+}
+
+static void append_size(struct clogger *c, size_t n)
+{
+	char buf[(sizeof(size_t) * 8) / 3 + 1];
+	int nr = snprintf(buf, sizeof(buf), "%lu", (unsigned long)n);
+
+	assert(nr > 0 && nr < (int)sizeof(buf));
+	field_cat(c, buf, nr);
+}
+
 static void append_time_fmt(struct clogger *c, VALUE op)
 {
 	struct timespec now;
-	int r = clock_gettime(CLOCK_REALTIME, &now);
+	int r = clock_gettime(c->real_clock, &now);
 
 	if (unlikely(r != 0))
-		rb_sys_fail("clock_gettime(CLOCK_REALTIME)");
+		rb_sys_fail("clock_gettime");
 	append_ts(c, op, &now);
 }
 
@@ -401,14 +831,14 @@ static void append_request_uri(struct clogger *c)
 	if (NIL_P(tmp)) {
 		tmp = rb_hash_aref(c->env, g_PATH_INFO);
 		if (!NIL_P(tmp))
-			rb_str_buf_append(c->log_buf, byte_xs(tmp));
+			field_xs_str(c, tmp);
 		tmp = rb_hash_aref(c->env, g_QUERY_STRING);
 		if (!NIL_P(tmp) && RSTRING_LEN(tmp) != 0) {
-			rb_str_buf_append(c->log_buf, g_question_mark);
-			rb_str_buf_append(c->log_buf, byte_xs(tmp));
+			field_str(c, g_question_mark);
+			field_xs_str(c, tmp);
 		}
 	} else {
-		rb_str_buf_append(c->log_buf, byte_xs(tmp));
+		field_xs_str(c, tmp);
 	}
 }
 
@@ -419,35 +849,40 @@ static void append_request(struct clogger *c)
 	/* REQUEST_METHOD doesn't need escaping, Rack::Lint governs it */
 	tmp = rb_hash_aref(c->env, g_REQUEST_METHOD);
 	if (!NIL_P(tmp))
-		rb_str_buf_append(c->log_buf, tmp);
+		field_str(c, tmp);
 
-	rb_str_buf_append(c->log_buf, g_space);
+	field_str(c, g_space);
 
 	append_request_uri(c);
 
 	/* HTTP_VERSION can be injected by malicious clients */
 	tmp = rb_hash_aref(c->env, g_HTTP_VERSION);
 	if (!NIL_P(tmp)) {
-		rb_str_buf_append(c->log_buf, g_space);
-		rb_str_buf_append(c->log_buf, byte_xs(tmp));
+		field_str(c, g_space);
+		field_xs_str(c, tmp);
 	}
 }
 
+/*
+ * never call rack.input.size here, TeeInput-style inputs would need to
+ * read and buffer the entire request body just for us to log a number
+ */
 static void append_request_length(struct clogger *c)
 {
-	VALUE tmp = rb_hash_aref(c->env, g_rack_input);
-	if (NIL_P(tmp)) {
-		rb_str_buf_append(c->log_buf, g_dash);
+	VALUE tmp = rb_hash_aref(c->env, g_CONTENT_LENGTH);
+
+	if (TYPE(tmp) == T_STRING && RSTRING_LEN(tmp) != 0) {
+		field_xs_str(c, tmp);
+	} else if (NIL_P(c->input)) {
+		field_str(c, g_dash);
 	} else {
-		tmp = rb_funcall(tmp, size_id, 0);
-		rb_str_buf_append(c->log_buf, rb_funcall(tmp, to_s_id, 0));
+		tmp = rb_funcall(c->input, bytes_read_id, 0);
+		field_str(c, rb_funcall(tmp, to_s_id, 0));
 	}
 }
 
-static long local_gmtoffset(struct tm *tm)
+static long local_gmtoffset(struct tm *tm, time_t t)
 {
-	time_t t = time(NULL);
-
 	tzset();
 	localtime_r(&t, tm);
 
@@ -462,60 +897,67 @@ static long local_gmtoffset(struct tm *tm)
 #endif
 }
 
-static void append_time_iso8601(struct clogger *c)
-{
-	char buf[sizeof("1970-01-01T00:00:00+00:00")];
-	struct tm tm;
-	int nr;
-	long gmtoff = local_gmtoffset(&tm);
-
-	nr = snprintf(buf, sizeof(buf),
-	              "%4d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d",
-	              tm.tm_year + 1900, tm.tm_mon + 1,
-	              tm.tm_mday, tm.tm_hour,
-	              tm.tm_min, tm.tm_sec,
-	              gmtoff < 0 ? '-' : '+',
-	              abs(gmtoff / 60), abs(gmtoff % 60));
-	assert(nr == (sizeof(buf) - 1) && "snprintf fail");
-	rb_str_buf_cat(c->log_buf, buf, sizeof(buf) - 1);
-}
-
 static const char months[] = "Jan\0Feb\0Mar\0Apr\0May\0Jun\0"
                              "Jul\0Aug\0Sep\0Oct\0Nov\0Dec";
 
-static void append_time_local(struct clogger *c)
+#define TIME_VAR_SIZE sizeof("01/Jan/1970:00:00:00 +0000")
+
+/*
+ * formats $time_iso8601, $time_local or $time_utc at +t+ into +buf+
+ * (TIME_VAR_SIZE bytes) and returns the length.  Doesn't touch Ruby,
+ * so :snapshot can call it without the GVL.
+ */
+static int fmt_time_var(char *buf, enum clogger_special var, time_t t)
 {
-	char buf[sizeof("01/Jan/1970:00:00:00 +0000")];
 	struct tm tm;
+	long gmtoff;
 	int nr;
-	long gmtoff = local_gmtoffset(&tm);
 
-	nr = snprintf(buf, sizeof(buf),
-	              "%02d/%s/%d:%02d:%02d:%02d %c%02d%02d",
-	              tm.tm_mday, months + (tm.tm_mon * sizeof("Jan")),
-	              tm.tm_year + 1900, tm.tm_hour,
-	              tm.tm_min, tm.tm_sec,
-	              gmtoff < 0 ? '-' : '+',
-	              abs(gmtoff / 60), abs(gmtoff % 60));
-	assert(nr == (sizeof(buf) - 1) && "snprintf fail");
-	rb_str_buf_cat(c->log_buf, buf, sizeof(buf) - 1);
+	switch (var) {
+	case CL_SP_time_iso8601:
+		gmtoff = local_gmtoffset(&tm, t);
+		nr = snprintf(buf, TIME_VAR_SIZE,
+		              "%4d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d",
+		              tm.tm_year + 1900, tm.tm_mon + 1,
+		              tm.tm_mday, tm.tm_hour,
+		              tm.tm_min, tm.tm_sec,
+		              gmtoff < 0 ? '-' : '+',
+		              abs(gmtoff / 60), abs(gmtoff % 60));
+		assert(nr == sizeof("1970-01-01T00:00:00+00:00") - 1 &&
+		       "snprintf fail");
+		return nr;
+	case CL_SP_time_local:
+		gmtoff = local_gmtoffset(&tm, t);
+		nr = snprintf(buf, TIME_VAR_SIZE,
+		              "%02d/%s/%d:%02d:%02d:%02d %c%02d%02d",
+		              tm.tm_mday, months + (tm.tm_mon * sizeof("Jan")),
+		              tm.tm_year + 1900, tm.tm_hour,
+		              tm.tm_min, tm.tm_sec,
+		              gmtoff < 0 ? '-' : '+',
+		              abs(gmtoff / 60), abs(gmtoff % 60));
+		break;
+	default: /* CL_SP_time_utc */
+		gmtime_r(&t, &tm);
+		nr = snprintf(buf, TIME_VAR_SIZE,
+		              "%02d/%s/%d:%02d:%02d:%02d +0000",
+		              tm.tm_mday, months + (tm.tm_mon * sizeof("Jan")),
+		              tm.tm_year + 1900, tm.tm_hour,
+		              tm.tm_min, tm.tm_sec);
+	}
+	assert(nr == TIME_VAR_SIZE - 1 && "snprintf fail");
+	return nr;
 }
 
-static void append_time_utc(struct clogger *c)
+static void append_time_var(struct clogger *c, enum clogger_special var)
 {
-	char buf[sizeof("01/Jan/1970:00:00:00 +0000")];
-	struct tm tm;
-	int nr;
+	char buf[TIME_VAR_SIZE];
 	time_t t = time(NULL);
 
-	gmtime_r(&t, &tm);
-	nr = snprintf(buf, sizeof(buf),
-	              "%02d/%s/%d:%02d:%02d:%02d +0000",
-	              tm.tm_mday, months + (tm.tm_mon * sizeof("Jan")),
-	              tm.tm_year + 1900, tm.tm_hour,
-	              tm.tm_min, tm.tm_sec);
-	assert(nr == (sizeof(buf) - 1) && "snprintf fail");
-	rb_str_buf_cat(c->log_buf, buf, sizeof(buf) - 1);
+	if (c->capture) {
+		snap_put(c->capture, SNAP_TIME, var, 0, t, NULL, 0);
+		return;
+	}
+	field_cat(c, buf, fmt_time_var(buf, var, t));
 }
 
 static void
@@ -527,6 +969,11 @@ append_time(struct clogger *c, enum clogger_opcode op, VALUE fmt, VALUE buf)
 	struct tm tmp;
 	time_t t = time(NULL);
 
+	if (c->capture) {
+		snap_put(c->capture, SNAP_STRFTIME, op, (long)buf_size, t,
+		         RSTRING_PTR(fmt), RSTRING_LEN(fmt));
+		return;
+	}
 	if (op == CL_OP_TIME_LOCAL)
 		localtime_r(&t, &tmp);
 	else if (op == CL_OP_TIME_UTC)
@@ -536,7 +983,7 @@ append_time(struct clogger *c, enum clogger_opcode op, VALUE fmt, VALUE buf)
 
 	nr = strftime(buf_ptr, buf_size, RSTRING_PTR(fmt), &tmp);
 	assert(nr < buf_size && "time format too small!");
-	rb_str_buf_cat(c->log_buf, buf_ptr, nr);
+	field_cat(c, buf_ptr, nr);
 }
 
 static void append_pid(struct clogger *c)
@@ -545,7 +992,7 @@ static void append_pid(struct clogger *c)
 	int nr = snprintf(buf, sizeof(buf), "%d", (int)getpid());
 
 	assert(nr > 0 && nr < (int)sizeof(buf));
-	rb_str_buf_cat(c->log_buf, buf, nr);
+	field_cat(c, buf, nr);
 }
 
 static void append_eval(struct clogger *c, VALUE str)
@@ -554,7 +1001,46 @@ static void append_eval(struct clogger *c, VALUE str)
 	VALUE rv = rb_eval_string_protect(RSTRING_PTR(str), &state);
 
 	rv = state == 0 ? rb_obj_as_string(rv) : g_dash;
-	rb_str_buf_append(c->log_buf, rv);
+	field_str(c, rv);
+}
+
+/*
+ * used when the app never parsed cookies: a single pass over HTTP_COOKIE
+ * which skips (without allocating) every cookie but +key+.  The first
+ * cookie wins, as it does with Rack::Request#cookies.
+ */
+static int cookie_scan(struct clogger *c, VALUE key)
+{
+	VALUE hdr = rb_hash_aref(c->env, g_HTTP_COOKIE);
+	const char *k = RSTRING_PTR(key);
+	long klen = RSTRING_LEN(key);
+	const char *p, *end;
+
+	if (TYPE(hdr) != T_STRING)
+		return 0;
+
+	p = RSTRING_PTR(hdr);
+	end = p + RSTRING_LEN(hdr);
+	while (p < end) {
+		const char *next = p;
+
+		while (next < end && *next != ';' && *next != ',')
+			next++;
+
+		if ((next - p) > klen && p[klen] == '=' &&
+		    memcmp(p, k, klen) == 0) {
+			p += klen + 1;
+			unescape_xs(c, p, next - p);
+			RB_GC_GUARD(hdr);
+			return 1;
+		}
+
+		/* skip spaces after separators, like Rack::Utils.parse_cookies */
+		for (p = next + 1; p < end && *p == ' '; p++)
+			;
+	}
+	RB_GC_GUARD(hdr);
+	return 0;
 }
 
 static void append_cookie(struct clogger *c, VALUE key)
@@ -565,20 +1051,74 @@ static void append_cookie(struct clogger *c, VALUE key)
 		c->cookies = rb_hash_aref(c->env, g_rack_request_cookie_hash);
 
 	if (NIL_P(c->cookies)) {
-		cookie = g_dash;
+		if (cookie_scan(c, key))
+			return;
+		cookie = Qnil;
 	} else {
 		cookie = rb_hash_aref(c->cookies, key);
-		cookie = NIL_P(cookie) ? g_dash : byte_xs(cookie);
 	}
-	rb_str_buf_append(c->log_buf, cookie);
+	if (NIL_P(cookie))
+		field_str(c, g_dash);
+	else
+		field_xs_str(c, cookie);
+}
+
+static int ascii_casecmp(const char *a, const char *b, long len)
+{
+	for (; --len >= 0; a++, b++) {
+		int x = *a, y = *b;
+
+		if (x >= 'A' && x <= 'Z')
+			x |= 0x20;
+		if (y >= 'A' && y <= 'Z')
+			y |= 0x20;
+		if (x != y)
+			return x - y;
+	}
+	return 0;
+}
+
+/*
+ * like nginx $arg_*: finds the first "key=" (case-insensitive) in
+ * QUERY_STRING in place, no params hash and no unescaping
+ */
+static void append_arg(struct clogger *c, VALUE key)
+{
+	VALUE qs = rb_hash_aref(c->env, g_QUERY_STRING);
+	const char *k = RSTRING_PTR(key);
+	long klen = RSTRING_LEN(key);
+	const char *p, *end;
+
+	if (TYPE(qs) == T_STRING) {
+		p = RSTRING_PTR(qs);
+		end = p + RSTRING_LEN(qs);
+		while (p < end) {
+			const char *next = memchr(p, '&', end - p);
+
+			if (!next)
+				next = end;
+			if ((next - p) > klen && p[klen] == '=' &&
+			    ascii_casecmp(p, k, klen) == 0) {
+				p += klen + 1;
+				field_xs(c, p, next - p);
+				RB_GC_GUARD(qs);
+				return;
+			}
+			p = next + 1;
+		}
+		RB_GC_GUARD(qs);
+	}
+	field_str(c, g_dash);
 }
 
 static void append_request_env(struct clogger *c, VALUE key)
 {
 	VALUE tmp = rb_hash_aref(c->env, key);
 
-	tmp = NIL_P(tmp) ? g_dash : byte_xs(tmp);
-	rb_str_buf_append(c->log_buf, tmp);
+	if (NIL_P(tmp))
+		field_str(c, g_dash);
+	else
+		field_xs_str(c, tmp);
 }
 
 static void append_response(struct clogger *c, VALUE key)
@@ -588,8 +1128,72 @@ static void append_response(struct clogger *c, VALUE key)
 	assert(rb_obj_is_kind_of(c->headers, cHeaderHash) && "not HeaderHash");
 
 	v = rb_funcall(c->headers, sq_brace_id, 1, key);
-	v = NIL_P(v) ? g_dash : byte_xs(v);
-	rb_str_buf_append(c->log_buf, v);
+	if (NIL_P(v))
+		field_str(c, g_dash);
+	else
+		field_xs_str(c, v);
+}
+
+/* once per request, the same ID goes to every output and :request_id */
+static void pick_request_id(struct clogger *c)
+{
+	VALUE tmp = rb_hash_aref(c->env, g_HTTP_X_REQUEST_ID);
+
+	if (TYPE(tmp) == T_STRING &&
+	    request_id_valid(RSTRING_PTR(tmp), RSTRING_LEN(tmp))) {
+		c->rid_len = (int)RSTRING_LEN(tmp);
+		memcpy(c->rid, RSTRING_PTR(tmp), c->rid_len);
+	} else {
+		request_id_new(c->rid);
+		c->rid_len = REQUEST_ID_LEN;
+	}
+}
+
+static void append_request_id(struct clogger *c)
+{
+	if (!c->rid_len)
+		pick_request_id(c);
+	field_cat(c, c->rid, c->rid_len);
+}
+
+/* calls +fn+ with the template of +path+, memoized if we can */
+static void path_template_do(struct path_tpl *pt, VALUE path,
+                             void (*fn)(void *, const char *, long), void *arg)
+{
+	const char *p = RSTRING_PTR(path);
+	long len = RSTRING_LEN(path);
+	struct path_tpl_slot *slot;
+	uint64_t hash = 0;
+	VALUE v;
+	char *buf;
+
+	slot = path_tpl_slot(pt, p, len, &hash);
+	if (slot && path_tpl_hit(slot, hash, p, len)) {
+		fn(arg, slot->tpl, slot->tpl_len);
+		return;
+	}
+	buf = ALLOCV(v, path_tpl_max(pt, p, len));
+	len = path_tpl_build(pt, p, len, buf);
+	if (slot)
+		path_tpl_store(slot, hash, p, RSTRING_LEN(path), buf, len);
+	fn(arg, buf, len);
+	ALLOCV_END(v);
+	RB_GC_GUARD(path); /* pinned while :path_patterns may allocate */
+}
+
+static void path_template_xs(void *c, const char *ptr, long len)
+{
+	field_xs(c, ptr, len);
+}
+
+static void append_path_template(struct clogger *c)
+{
+	VALUE path = rb_hash_aref(c->env, g_PATH_INFO);
+
+	if (TYPE(path) == T_STRING)
+		path_template_do(c->pt, path, path_template_xs, c);
+	else
+		field_str(c, g_dash);
 }
 
 static void special_var(struct clogger *c, enum clogger_special var)
@@ -609,7 +1213,7 @@ static void special_var(struct clogger *c, enum clogger_special var)
 		break;
 	case CL_SP_response_length:
 		if (c->body_bytes_sent == 0)
-			rb_str_buf_append(c->log_buf, g_dash);
+			field_str(c, g_dash);
 		else
 			append_body_bytes_sent(c);
 		break;
@@ -623,115 +1227,1038 @@ static void special_var(struct clogger *c, enum clogger_special var)
 		append_request_uri(c);
 		break;
 	case CL_SP_time_iso8601:
-		append_time_iso8601(c);
-		break;
 	case CL_SP_time_local:
-		append_time_local(c);
-		break;
 	case CL_SP_time_utc:
-		append_time_utc(c);
+		append_time_var(c, var);
+		break;
+	case CL_SP_real_ip:
+		append_real_ip(c);
+		break;
+	case CL_SP_gc_count:
+		append_size(c, rb_gc_count() - c->gc_count_start);
+		break;
+	case CL_SP_allocated_objects:
+		append_size(c, rb_gc_stat(sym_total_allocated_objects) -
+		               c->alloc_start);
+		break;
+	case CL_SP_repeat_count: /* see dedup_summary */
+		field_cat(c, "1", 1);
+		break;
+	case CL_SP_request_id:
+		append_request_id(c);
+		break;
+	case CL_SP_path_template:
+		append_path_template(c);
 	}
 }
 
-static VALUE cwrite(struct clogger *c)
+/* variables may be capped with a "{MAX}" suffix, e.g. $http_referer{256} */
+static long op_max(VALUE op, enum clogger_opcode opcode)
 {
-	const VALUE ops = c->fmt_ops;
-	long i;
-	long len = RARRAY_LEN(ops);
-	VALUE dst = c->log_buf;
-
-	rb_str_set_len(dst, 0);
-
-	for (i = 0; i < len; i++) {
-		VALUE op = rb_ary_entry(ops, i);
-		enum clogger_opcode opcode = FIX2INT(rb_ary_entry(op, 0));
-		VALUE op1 = rb_ary_entry(op, 1);
-
-		switch (opcode) {
-		case CL_OP_LITERAL:
-			rb_str_buf_append(dst, op1);
-			break;
-		case CL_OP_REQUEST:
-			append_request_env(c, op1);
-			break;
-		case CL_OP_RESPONSE:
-			append_response(c, op1);
-			break;
-		case CL_OP_SPECIAL:
-			special_var(c, FIX2INT(op1));
-			break;
-		case CL_OP_EVAL:
-			append_eval(c, op1);
-			break;
-		case CL_OP_TIME_LOCAL:
-		case CL_OP_TIME_UTC: {
-			VALUE arg2 = rb_ary_entry(op, 2);
-			append_time(c, opcode, op1, arg2);
-		}
-			break;
-		case CL_OP_REQUEST_TIME:
-			append_request_time_fmt(c, op);
-			break;
-		case CL_OP_TIME:
-			append_time_fmt(c, op);
-			break;
-		case CL_OP_COOKIE:
-			append_cookie(c, op1);
-			break;
-		}
-	}
-
-	if (c->fd >= 0) {
-		write_full(c->fd, RSTRING_PTR(dst), RSTRING_LEN(dst));
-		/* no need for RB_GC_GUARD(dst) here, marked as c->log_buf */
-	} else {
-		VALUE logger = c->logger;
-
-		if (NIL_P(logger)) {
-			logger = rb_hash_aref(c->env, g_rack_errors);
-                        rb_funcall(logger, write_id, 1, dst);
-                } else {
-			rb_funcall(logger, ltlt_id, 1, dst);
-		}
+	VALUE max;
+
+	switch (opcode) {
+	case CL_OP_REQUEST:
+	case CL_OP_RESPONSE:
+	case CL_OP_SPECIAL:
+	case CL_OP_COOKIE:
+	case CL_OP_ARG:
+		max = rb_ary_entry(op, 2);
+		return NIL_P(max) ? LONG_MAX : NUM2LONG(max);
+	default:
+		return LONG_MAX;
 	}
-
-	return Qnil;
 }
 
-static VALUE clogger_write(VALUE self)
+/* the trailing literal (usually ORS) survives :max_line_length cuts */
+static long tail_len(VALUE ops)
 {
-	return cwrite(clogger_get(self));
+	long len = RARRAY_LEN(ops);
+	VALUE op;
+
+	if (len == 0)
+		return 0;
+	op = rb_ary_entry(ops, len - 1);
+	if (FIX2INT(rb_ary_entry(op, 0)) != CL_OP_LITERAL)
+		return 0;
+	return RSTRING_LEN(rb_ary_entry(op, 1));
 }
 
-static void init_logger(struct clogger *c, VALUE path)
+/* makes room for TRUNC_MARK so {N} holds at most N bytes, mark included */
+static void field_trunc(struct clogger *c, long start, long max)
 {
-	ID id;
+	long cut = RSTRING_LEN(c->log_buf);
+	long n = start + max - (long)TRUNC_MARK_LEN;
+
+	if (n < start)
+		n = start;
+	if (n < cut)
+		rb_str_set_len(c->log_buf, n);
+	trim_escape(c->log_buf, start, c->xs_utf8);
+	c->line_left += cut - RSTRING_LEN(c->log_buf); /* trimmed */
+	c->field_left = max - (RSTRING_LEN(c->log_buf) - start);
+	field_cat(c, TRUNC_MARK, TRUNC_MARK_LEN);
+}
 
-	if (!NIL_P(path) && !NIL_P(c->logger))
-		rb_raise(rb_eArgError, ":logger and :path are independent");
-	if (!NIL_P(path)) {
-		VALUE ab = rb_str_new2("ab");
-		id = rb_intern("open");
-		c->logger = rb_funcall(rb_cFile, id, 2, path, ab);
+static void finish_line(struct clogger *c, long max_line, long tail)
+{
+	if (unlikely(c->line_cut)) {
+		long n = max_line - tail - (long)TRUNC_MARK_LEN;
+
+		if (n < 0)
+			n = 0;
+		if (n < RSTRING_LEN(c->log_buf))
+			rb_str_set_len(c->log_buf, n);
+		trim_escape(c->log_buf, 0, c->xs_utf8);
+		rb_str_buf_cat(c->log_buf, TRUNC_MARK, TRUNC_MARK_LEN);
 	}
+	c->line_left = LONG_MAX;
+}
 
-	id = rb_intern("sync=");
-	if (rb_respond_to(c->logger, id))
-		rb_funcall(c->logger, id, 1, Qtrue);
-
-	id = rb_intern("fileno");
-	if (rb_respond_to(c->logger, id))
-		c->fd = raw_fd(rb_funcall(c->logger, id, 0));
+/* probe arguments must be cheap, don't call status.to_i here */
+static inline int probe_status(VALUE status)
+{
+	return FIXNUM_P(status) ? FIX2INT(status) : 0;
 }
 
-/**
- * call-seq:
+static void
+append_op(struct clogger *c, VALUE op, enum clogger_opcode opcode, VALUE op1)
+{
+	switch (opcode) {
+	case CL_OP_LITERAL:
+		field_str(c, op1);
+		break;
+	case CL_OP_REQUEST:
+		append_request_env(c, op1);
+		break;
+	case CL_OP_RESPONSE:
+		append_response(c, op1);
+		break;
+	case CL_OP_SPECIAL:
+		special_var(c, FIX2INT(op1));
+		break;
+	case CL_OP_EVAL:
+		append_eval(c, op1);
+		break;
+	case CL_OP_TIME_LOCAL:
+	case CL_OP_TIME_UTC: {
+		VALUE arg2 = rb_ary_entry(op, 2);
+		append_time(c, opcode, op1, arg2);
+	}
+		break;
+	case CL_OP_REQUEST_TIME:
+		append_request_time_fmt(c, op);
+		break;
+	case CL_OP_TIME:
+		append_time_fmt(c, op);
+		break;
+	case CL_OP_COOKIE:
+		append_cookie(c, op1);
+		break;
+	case CL_OP_ARG:
+		append_arg(c, op1);
+		break;
+	case CL_OP_CPU_TIME:
+		append_cpu_time_fmt(c, op);
+		break;
+	case CL_OP_GC_TIME:
+		append_gc_time_fmt(c, op);
+		break;
+	}
+}
+
+/* values which are the same no matter which output renders them */
+static inline int cacheable(enum clogger_opcode opcode)
+{
+	switch (opcode) {
+	case CL_OP_REQUEST:
+	case CL_OP_RESPONSE:
+	case CL_OP_SPECIAL:
+	case CL_OP_COOKIE:
+	case CL_OP_ARG:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* outputs compile their own formats, so names only match by content */
+static int fc_key_eq(VALUE a, VALUE b)
+{
+	if (a == b)
+		return 1;
+	if (FIXNUM_P(a) || FIXNUM_P(b))
+		return 0;
+	return RSTRING_LEN(a) == RSTRING_LEN(b) &&
+	       !memcmp(RSTRING_PTR(a), RSTRING_PTR(b), RSTRING_LEN(a));
+}
+
+struct fc_fill_args {
+	struct clogger *c;
+	VALUE op;
+	enum clogger_opcode opcode;
+	VALUE op1;
+	VALUE buf;
+	long field_left;
+	long line_left;
+	int line_cut;
+};
+
+static VALUE fc_fill_i(VALUE p)
+{
+	struct fc_fill_args *a = (struct fc_fill_args *)p;
+
+	append_op(a->c, a->op, a->opcode, a->op1);
+	return Qnil;
+}
+
+/* lookups may raise, don't leave the caller writing uncapped into snap */
+static VALUE fc_fill_done(VALUE p)
+{
+	struct fc_fill_args *a = (struct fc_fill_args *)p;
+
+	a->c->log_buf = a->buf;
+	a->c->field_left = a->field_left;
+	a->c->line_left = a->line_left;
+	a->c->line_cut = a->line_cut;
+	return Qnil;
+}
+
+/*
+ * looks up, escapes and stashes the full value in c->fc->snap on first
+ * use, every output (and cap) after that is a single field_cat from it
+ */
+static void append_cached(struct clogger *c, VALUE op,
+                          enum clogger_opcode opcode, VALUE op1)
+{
+	struct field_cache *cache = c->fc;
+	VALUE snap = cache->snap;
+	struct fc_entry *fc = NULL;
+	int i;
+
+	for (i = 0; i < cache->len; i++) {
+		if (cache->ent[i].opcode == (int)opcode &&
+		    fc_key_eq(cache->ent[i].key, op1)) {
+			fc = &cache->ent[i];
+			break;
+		}
+	}
+
+	if (!fc) {
+		struct fc_fill_args a;
+
+		if (cache->len == FIELD_CACHE_SIZE) {
+			append_op(c, op, opcode, op1);
+			return;
+		}
+		a.c = c;
+		a.op = op;
+		a.opcode = opcode;
+		a.op1 = op1;
+		a.buf = c->log_buf;
+		a.field_left = c->field_left;
+		a.line_left = c->line_left;
+		a.line_cut = c->line_cut;
+
+		fc = &cache->ent[cache->len];
+		fc->key = op1;
+		fc->opcode = opcode;
+		fc->off = RSTRING_LEN(snap);
+
+		c->log_buf = snap;
+		c->field_left = c->line_left = LONG_MAX;
+		c->line_cut = 0;
+		rb_ensure(fc_fill_i, (VALUE)&a, fc_fill_done, (VALUE)&a);
+
+		fc->len = RSTRING_LEN(snap) - fc->off;
+		cache->len++; /* only once it's filled */
+	}
+	field_cat(c, RSTRING_PTR(snap) + fc->off, fc->len);
+}
+
+/* variables which differ between otherwise identical requests */
+static int volatile_op(enum clogger_opcode opcode, VALUE op1)
+{
+	switch (opcode) {
+	case CL_OP_TIME_LOCAL:
+	case CL_OP_TIME_UTC:
+	case CL_OP_REQUEST_TIME:
+	case CL_OP_TIME:
+	case CL_OP_CPU_TIME:
+	case CL_OP_GC_TIME:
+		return 1;
+	case CL_OP_SPECIAL:
+		switch (FIX2INT(op1)) {
+		case CL_SP_time_iso8601:
+		case CL_SP_time_local:
+		case CL_SP_time_utc:
+		case CL_SP_gc_count:
+		case CL_SP_allocated_objects:
+		case CL_SP_repeat_count:
+		case CL_SP_request_id:
+			return 1;
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/* renders the format of output +o+ with the request state of +c+ */
+static void render(struct clogger *c, const struct clogger *o)
+{
+	const VALUE ops = o->fmt_ops;
+	long i;
+	long len = RARRAY_LEN(ops);
+	long tail = o->max_line < 0 ? 0 : tail_len(ops);
+	int use_cache = c->fc != NULL;
+	VALUE dst = c->log_buf;
+
+	rb_str_set_len(dst, 0);
+	c->line_left = o->max_line < 0 ? LONG_MAX : o->max_line - tail;
+	c->line_cut = 0;
+	c->line_hash = 0;
+	c->count_off = -1;
+
+	for (i = 0; i < len; i++) {
+		VALUE op = rb_ary_entry(ops, i);
+		enum clogger_opcode opcode = FIX2INT(rb_ary_entry(op, 0));
+		VALUE op1 = rb_ary_entry(op, 1);
+		long start = RSTRING_LEN(dst);
+
+		long max = op_max(op, opcode);
+
+		if (tail && i == len - 1)
+			finish_line(c, o->max_line, tail);
+		c->field_left = max;
+		c->field_cut = 0;
+
+		if (use_cache && cacheable(opcode))
+			append_cached(c, op, opcode, op1);
+		else
+			append_op(c, op, opcode, op1);
+
+		if (unlikely(c->field_cut) && !c->line_cut)
+			field_trunc(c, start, max);
+
+		if (o->dd) {
+			if (opcode == CL_OP_SPECIAL &&
+			    FIX2INT(op1) == CL_SP_repeat_count) {
+				c->count_off = start;
+				c->count_len = RSTRING_LEN(dst) - start;
+			}
+			if (!volatile_op(opcode, op1))
+				c->line_hash = dedup_hash(c->line_hash,
+				                          RSTRING_PTR(dst) + start,
+				                          RSTRING_LEN(dst) - start);
+		}
+	}
+	if (!tail)
+		finish_line(c, o->max_line, 0);
+}
+
+/*
+ * :snapshot rendering, this mirrors field_cat, field_xs, trim_escape,
+ * finish_line and render but works on sn->out without the GVL
+ */
+struct snap_render {
+	struct snapshot *sn;
+	long field_left;
+	long line_left;
+	int field_cut;
+	int line_cut;
+	size_t start; /* of the current variable */
+	long field_max; /* its {N} */
+};
+
+static void snap_cat(struct snap_render *r, const char *ptr, long len)
+{
+	if (unlikely(len > r->field_left)) {
+		len = r->field_left;
+		r->field_cut = 1;
+	}
+	if (unlikely(len > r->line_left)) {
+		len = r->line_left;
+		r->line_cut = 1;
+	}
+	if (len > 0 && snap_out_reserve(r->sn, len)) {
+		r->field_left -= len;
+		r->line_left -= len;
+		memcpy(r->sn->out + r->sn->out_len, ptr, len);
+		r->sn->out_len += len;
+	}
+}
+
+static void snap_xs(struct snap_render *r, const char *ptr, long len)
+{
+	const unsigned char *p = (const unsigned char *)ptr;
+	const unsigned char *end = p + len;
+	char x[4] = { '\\', 'x', 0, 0 };
+
+	while (p < end) {
+		long n = xs_run(p, end, r->sn->utf8);
+
+		if (n) {
+			snap_cat(r, (const char *)p, n);
+			p += n;
+			if (p == end)
+				return;
+		}
+		x[2] = esc[*p >> 4];
+		x[3] = esc[*p & 0xf];
+		snap_cat(r, x, sizeof(x));
+		if (unlikely(r->field_cut || r->line_cut))
+			return;
+		p++;
+	}
+}
+
+static void snap_trim_escape(struct snapshot *sn, size_t floor)
+{
+	const char *p = sn->out;
+	size_t n = sn->out_len;
+
+	if (n >= floor + 1 && p[n - 1] == '\\')
+		n -= 1;
+	else if (n >= floor + 2 && p[n - 2] == '\\' && p[n - 1] == 'x')
+		n -= 2;
+	else if (n >= floor + 3 && p[n - 3] == '\\' && p[n - 2] == 'x')
+		n -= 3;
+	else if (sn->utf8)
+		n = utf8_trim(p, n, floor);
+	sn->out_len = n;
+}
+
+static void snap_trunc_mark(struct snapshot *sn)
+{
+	if (snap_out_reserve(sn, TRUNC_MARK_LEN)) {
+		memcpy(sn->out + sn->out_len, TRUNC_MARK, TRUNC_MARK_LEN);
+		sn->out_len += TRUNC_MARK_LEN;
+	}
+}
+
+static void snap_field_done(struct snap_render *r)
+{
+	if (unlikely(r->field_cut) && !r->line_cut) {
+		size_t cut = r->sn->out_len;
+		long n = r->field_max - (long)TRUNC_MARK_LEN;
+
+		if (n < 0)
+			n = 0;
+		if (r->start + n < cut)
+			r->sn->out_len = r->start + n;
+		snap_trim_escape(r->sn, r->start);
+		r->line_left += cut - r->sn->out_len; /* trimmed */
+		r->field_left = r->field_max - (r->sn->out_len - r->start);
+		snap_cat(r, TRUNC_MARK, TRUNC_MARK_LEN);
+	}
+}
+
+static void snap_finish_line(struct snap_render *r, long max_line, long tail)
+{
+	if (unlikely(r->line_cut)) {
+		long n = max_line - tail - (long)TRUNC_MARK_LEN;
+
+		if (n < 0)
+			n = 0;
+		if ((size_t)n < r->sn->out_len)
+			r->sn->out_len = n;
+		snap_trim_escape(r->sn, 0);
+		snap_trunc_mark(r->sn);
+	}
+	r->line_left = LONG_MAX;
+}
+
+static void snap_strftime(struct snap_render *r, const struct snap_seg *seg,
+                          const char *fmt)
+{
+	char *buf = malloc(seg->len + 1 + seg->n);
+	struct tm tm;
+	size_t nr;
+
+	if (!buf) {
+		r->sn->enomem = 1;
+		return;
+	}
+	memcpy(buf, fmt, seg->len);
+	buf[seg->len] = 0;
+	if (seg->arg == CL_OP_TIME_LOCAL)
+		localtime_r(&seg->t, &tm);
+	else
+		gmtime_r(&seg->t, &tm);
+	nr = strftime(buf + seg->len + 1, seg->n, buf, &tm);
+	snap_cat(r, buf + seg->len + 1, nr);
+	free(buf);
+}
+
+static void snap_render(struct snapshot *sn, long max_line, long tail)
+{
+	struct snap_render r;
+	const char *p = sn->ptr;
+	const char *end = p + sn->len;
+
+	r.sn = sn;
+	r.field_left = LONG_MAX;
+	r.line_left = max_line < 0 ? LONG_MAX : max_line - tail;
+	r.field_cut = r.line_cut = 0;
+	r.start = 0;
+	r.field_max = LONG_MAX;
+	sn->out_len = 0;
+	sn->enomem = 0;
+
+	while (p < end) {
+		struct snap_seg seg;
+		const char *payload = p + sizeof(seg);
+		char buf[TIME_VAR_SIZE];
+
+		memcpy(&seg, p, sizeof(seg));
+		p = payload + seg.len;
+		switch (seg.kind) {
+		case SNAP_OP:
+			snap_field_done(&r);
+			if (seg.arg)
+				snap_finish_line(&r, max_line, tail);
+			r.field_left = r.field_max = seg.n;
+			r.field_cut = 0;
+			r.start = sn->out_len;
+			break;
+		case SNAP_RAW:
+			snap_cat(&r, payload, seg.len);
+			break;
+		case SNAP_XS:
+			snap_xs(&r, payload, seg.len);
+			break;
+		case SNAP_TIME:
+			snap_cat(&r, buf, fmt_time_var(buf, seg.arg, seg.t));
+			break;
+		case SNAP_STRFTIME:
+			snap_strftime(&r, &seg, payload);
+		}
+	}
+	snap_field_done(&r);
+	if (!tail)
+		snap_finish_line(&r, max_line, 0);
+}
+
+/* copies what output +o+ needs from the request state of +c+ into c->sn */
+static void capture(struct clogger *c, const struct clogger *o)
+{
+	const VALUE ops = o->fmt_ops;
+	long i;
+	long len = RARRAY_LEN(ops);
+	long tail = o->max_line < 0 ? 0 : tail_len(ops);
+
+	c->sn->len = 0;
+	c->capture = c->sn;
+	for (i = 0; i < len; i++) {
+		VALUE op = rb_ary_entry(ops, i);
+		enum clogger_opcode opcode = FIX2INT(rb_ary_entry(op, 0));
+
+		snap_put(c->sn, SNAP_OP, tail && i == len - 1,
+		         op_max(op, opcode), 0, NULL, 0);
+		append_op(c, op, opcode, rb_ary_entry(op, 1));
+	}
+	c->capture = NULL;
+}
+
+struct snap_job {
+	struct clogger_stats *st;
+	struct snapshot *sn;
+	long max_line;
+	long tail;
+	struct log_fd *f; /* NULL: only render */
+	int err;
+};
+
+static void *snap_job_run(void *p)
+{
+	struct snap_job *j = p;
+	const char *buf;
+	size_t count;
+
+	snap_render(j->sn, j->max_line, j->tail);
+	if (!j->f || j->sn->enomem)
+		return NULL;
+
+	/* write_full, minus the exceptions */
+	buf = j->sn->out;
+	count = j->sn->out_len;
+	while (count > 0) {
+		ssize_t r = write(j->f->fd, buf, count);
+
+		STAT_ADD(j->st, write_calls, 1);
+		if ((size_t)r == count) {
+			break;
+		} else if (r > 0) {
+			STAT_ADD(j->st, short_writes, 1);
+			count -= r;
+			buf += r;
+		} else if (errno == EINTR || errno == EAGAIN) {
+			STAT_ADD(j->st, write_retries, 1);
+		} else {
+			j->err = errno ? errno : ENOSPC;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static VALUE snap_job_i(VALUE p)
+{
+	struct snap_job *j = (struct snap_job *)p;
+
+#ifdef WITHOUT_GVL
+	WITHOUT_GVL(snap_job_run, j, RUBY_UBF_IO, 0);
+#else
+	snap_job_run(j);
+#endif
+	return Qnil;
+}
+
+static VALUE snap_job_done(VALUE p)
+{
+	struct snap_job *j = (struct snap_job *)p;
+
+	if (j->f)
+		log_fd_put(j->f);
+	return Qnil;
+}
+
+/* bookkeeping once a +len+ byte line went to the sink of output +o+ */
+static void emit_done(struct clogger_stats *st, const struct clogger *o,
+                      long len)
+{
+	/* renaming and opening files is left to a background thread */
+	if (o->lf && unlikely(log_file_due(o->lf))) {
+		o->lf->rotating = 1;
+		rb_funcall(cClogger, rotate_later_id, 1, o->lf->owner);
+	}
+
+	STAT_ADD(st, lines, 1);
+	STAT_ADD(st, bytes, len);
+	STAT_MAX(st, log_buf_max, len);
+}
+
+/*
+ * lines logged from a non-blocking fiber would stall the scheduler's
+ * whole thread in write(2), so they're left to the background flusher.
+ * Once a line is in there, the ones after it follow until it's written
+ * out to keep them in order.
+ */
+static int fiber_buffered(const struct clogger *o)
+{
+	struct line_buffer *fb = o->fb;
+
+	return fb && (fb->len || fb->flushing || fiber_scheduler_p());
+}
+
+static void fiber_buffer_cat(const struct clogger *o, VALUE str,
+                             const struct timespec *now)
+{
+	struct line_buffer *fb = o->fb;
+
+	if (line_buffer_cat(fb, RSTRING_PTR(str), RSTRING_LEN(str))) {
+		line_buffer_arm(fb, now);
+		if (!fb->registered) {
+			fb->registered = 1;
+			rb_funcall(cClogger, register_buffer_id, 2,
+			           o->lf->owner,
+			           rb_float_new(fb->interval_ns / 1e9));
+		}
+		rb_funcall(cClogger, start_flusher_id, 0);
+	} else if (!fb->flushing && line_buffer_due(fb, now)) {
+		rb_funcall(cClogger, flush_soon_id, 0);
+	}
+}
+
+/* writes +str+ to the sink of output +o+ */
+static void emit(struct clogger_stats *st, const struct clogger *o,
+                 VALUE env, VALUE str, const struct timespec *now)
+{
+	if (o->lf && !NIL_P(o->lf->index))
+		log_file_note(o->lf, RSTRING_LEN(str));
+	if (o->lb) {
+		if (line_buffer_cat(o->lb, RSTRING_PTR(str), RSTRING_LEN(str))) {
+			line_buffer_arm(o->lb, now);
+			rb_funcall(cClogger, start_flusher_id, 0);
+		}
+		if (line_buffer_due(o->lb, now))
+			lb_flush(st, o->lf, o->lb, 0);
+	} else if (o->lf) {
+		if (fiber_buffered(o))
+			fiber_buffer_cat(o, str, now);
+		else
+			lf_write(st, o->lf, RSTRING_PTR(str), RSTRING_LEN(str));
+	} else {
+		VALUE logger = o->logger;
+
+		STAT_ADD(st, logger_lines, 1);
+		if (NIL_P(logger)) {
+			logger = rb_hash_aref(env, g_rack_errors);
+			rb_funcall(logger, write_id, 1, str);
+		} else {
+			rb_funcall(logger, ltlt_id, 1, str);
+		}
+	}
+
+	emit_done(st, o, RSTRING_LEN(str));
+	RB_GC_GUARD(str);
+}
+
+/* writes the last line suppressed by +s+, with its $repeat_count */
+static void dedup_summary(struct clogger_stats *st, const struct clogger *o,
+                          struct dedup_slot *s, const struct timespec *now)
+{
+	VALUE str;
+	char buf[sizeof(unsigned long) * 3 + 1];
+	long n, off = s->count_off;
+
+	if (s->repeats == 0)
+		return;
+	n = snprintf(buf, sizeof(buf), "%lu", s->repeats);
+	if (off < 0 || off + s->count_len > s->line_len) {
+		str = rb_str_new(s->line, s->line_len);
+	} else {
+		str = rb_str_buf_new(s->line_len + n);
+		rb_str_buf_cat(str, s->line, off);
+		rb_str_buf_cat(str, buf, n);
+		off += s->count_len;
+		rb_str_buf_cat(str, s->line + off, s->line_len - off);
+	}
+	s->repeats = 0;
+	emit(st, o, Qnil, str, now);
+}
+
+/*
+ * returns true if the line in c->log_buf repeats the last one written
+ * for its PATH_INFO prefix within the window.  Otherwise, the summary
+ * of the previous run (if any) goes out first and a new window starts.
+ */
+static int dedup_check(struct clogger *c, const struct clogger *o,
+                       const struct timespec *now)
+{
+	VALUE dst = c->log_buf;
+	long len = RSTRING_LEN(dst);
+	struct dedup_slot *s;
+
+	s = dedup_slot(o->dd, rb_hash_aref(c->env, g_PATH_INFO));
+	if (!s)
+		return 0;
+	if (s->have_hash && s->hash == c->line_hash &&
+	    ts_before(now, &s->end) && len <= DEDUP_LINE_MAX) {
+		if (s->repeats++ == 0)
+			rb_funcall(cClogger, start_flusher_id, 0);
+		memcpy(s->line, RSTRING_PTR(dst), len);
+		s->line_len = len;
+		s->count_off = c->count_off;
+		s->count_len = c->count_len;
+		return 1;
+	}
+	dedup_summary(c->st, o, s, now);
+	s->have_hash = 1;
+	s->hash = c->line_hash;
+	dedup_arm(s, now);
+	return 0;
+}
+
+/* summarizes runs whose window is over, or all of them with +force+ */
+static void dedup_flush(struct clogger_stats *st, const struct clogger *o,
+                        int force)
+{
+	struct timespec now;
+	long i;
+
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	for (i = 0; i < o->dd->nr; i++) {
+		struct dedup_slot *s = &o->dd->slots[i];
+
+		if (!force && ts_before(&now, &s->end))
+			continue;
+		dedup_summary(st, o, s, &now);
+		s->have_hash = 0;
+	}
+}
+
+/* a memcpy into the :flight_recorder ring, one per rendered line */
+static void
+flight_record(struct clogger *c, const struct clogger *o, const char *line,
+              long len)
+{
+	struct timespec now, rt;
+
+	clock_gettime(c->real_clock, &now);
+	clock_gettime(c->mono_clock, &rt);
+	clock_diff(&rt, &c->ts_start);
+	fr_put(o->fr, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+	       (uint64_t)rt.tv_sec * 1000000000 + rt.tv_nsec,
+	       probe_status(c->status), line, len);
+}
+
+/*
+ * :snapshot counterpart of render + emit.  Only capture() holds the
+ * GVL; plain descriptors are also written to without it.  Lines for
+ * a :buffer, :index, :logger or rack.errors go through emit() as usual.
+ */
+static long write_snapshot(struct clogger *c, const struct clogger *o)
+{
+	struct snap_job j;
+	struct timespec t0, t1, t2;
+	int direct = o->lf && !o->lb && NIL_P(o->lf->index) &&
+	             !fiber_buffered(o);
+
+	CLOGGER_PROBE(format__start);
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &t0);
+	capture(c, o);
+	STAT_TIME(c->st, format_time, &t0, &t1);
+
+	j.st = c->st;
+	j.sn = c->sn;
+	j.max_line = o->max_line;
+	j.tail = o->max_line < 0 ? 0 : tail_len(o->fmt_ops);
+	j.f = direct ? log_fd_get(o->lf) : NULL;
+	j.err = 0;
+	rb_ensure(snap_job_i, (VALUE)&j, snap_job_done, (VALUE)&j);
+	if (c->sn->enomem)
+		rb_memerror();
+	CLOGGER_PROBE2(format__done, probe_status(c->status), c->sn->out_len);
+	if (o->fr)
+		flight_record(c, o, c->sn->out, c->sn->out_len);
+
+	if (direct) {
+		if (j.err) {
+			errno = j.err;
+			rb_sys_fail("write");
+		}
+		o->lf->size += c->sn->out_len;
+		emit_done(c->st, o, c->sn->out_len);
+	} else {
+		VALUE dst = c->log_buf;
+
+		rb_str_set_len(dst, 0);
+		rb_str_buf_cat(dst, c->sn->out, c->sn->out_len);
+		emit(c->st, o, c->env, dst, &t1);
+	}
+
+	STAT_TIME(c->st, write_time, &t1, &t2);
+	CLOGGER_PROBE3(write__done, probe_status(c->status),
+	               c->body_bytes_sent, c->sn->out_len);
+
+	return c->sn->out_len;
+}
+
+/* returns the length of the line written, zero if it was skipped */
+static long write_output(struct clogger *c, const struct clogger *o)
+{
+	VALUE dst = c->log_buf;
+	struct timespec t0, t1, t2;
+
+	if (!NIL_P(o->cond) &&
+	    !RTEST(rb_funcall(o->cond, call_id, 2, c->env, c->status)))
+		return 0;
+
+	if (c->sn)
+		return write_snapshot(c, o);
+
+	CLOGGER_PROBE(format__start);
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &t0);
+	render(c, o);
+	STAT_TIME(c->st, format_time, &t0, &t1);
+	CLOGGER_PROBE2(format__done, probe_status(c->status), RSTRING_LEN(dst));
+	if (o->fr)
+		flight_record(c, o, RSTRING_PTR(dst), RSTRING_LEN(dst));
+
+	if (o->dd && dedup_check(c, o, &t1)) {
+		STAT_ADD(c->st, suppressed, 1);
+		return 0;
+	}
+	emit(c->st, o, c->env, dst, &t1);
+
+	STAT_TIME(c->st, write_time, &t1, &t2);
+	CLOGGER_PROBE3(write__done, probe_status(c->status),
+	               c->body_bytes_sent, RSTRING_LEN(dst));
+
+	return RSTRING_LEN(dst);
+}
+
+static VALUE cwrite(struct clogger *c)
+{
+	long max = 0;
+
+	if (NIL_P(c->outputs)) {
+		max = write_output(c, c);
+	} else {
+		long i, n;
+
+		c->fc->len = 0;
+		rb_str_set_len(c->fc->snap, 0);
+		for (i = 0; i < RARRAY_LEN(c->outputs); i++) {
+			VALUE o = rb_ary_entry(c->outputs, i);
+
+			n = write_output(c, clogger_get(o));
+			if (n > max)
+				max = n;
+		}
+		if (RSTRING_LEN(c->fc->snap) > max)
+			max = RSTRING_LEN(c->fc->snap);
+	}
+
+	/* don't let one outlier keep a huge buffer around forever */
+	if (unlikely(max > LOG_BUF_SHRINK_SIZE))
+		init_buffers(c);
+
+	return Qnil;
+}
+
+static VALUE clogger_write(VALUE self)
+{
+	return cwrite(clogger_get(self));
+}
+
+static void init_logger(VALUE self, struct clogger *c, VALUE path)
+{
+	ID id;
+	int fd;
+
+	if (!NIL_P(path) && !NIL_P(c->logger))
+		rb_raise(rb_eArgError, ":logger and :path are independent");
+	if (!NIL_P(path)) {
+		VALUE ab = rb_str_new2("ab");
+		id = rb_intern("open");
+		c->logger = rb_funcall(rb_cFile, id, 2, path, ab);
+	}
+
+	id = rb_intern("sync=");
+	if (rb_respond_to(c->logger, id))
+		rb_funcall(c->logger, id, 1, Qtrue);
+
+	id = rb_intern("fileno");
+	if (!rb_respond_to(c->logger, id))
+		return;
+	fd = raw_fd(rb_funcall(c->logger, id, 0));
+	if (fd < 0)
+		return;
+
+	/* descriptors we opened are ours to close once they're swapped out */
+	if (!NIL_P(path))
+		rb_funcall(c->logger, rb_intern("autoclose="), 1, Qfalse);
+	c->logfile = log_file_new(&c->lf, fd, path, self);
+	if (!NIL_P(path))
+		rb_funcall(cClogger, rb_intern("register_path"), 1, self);
+}
+
+static void init_rotation(struct clogger *c, VALUE size, VALUE interval)
+{
+	if (!c->lf || NIL_P(c->lf->path))
+		rb_raise(rb_eArgError, "rotation needs a :path");
+	if (!NIL_P(size)) {
+		c->lf->rotate_size = NUM2OFFT(size);
+		if (c->lf->rotate_size <= 0)
+			rb_raise(rb_eArgError, ":rotate_size must be positive");
+	}
+	if (!NIL_P(interval)) {
+		c->lf->rotate_interval = NUM2LONG(interval);
+		if (c->lf->rotate_interval <= 0)
+			rb_raise(rb_eArgError,
+			         ":rotate_interval must be positive");
+	}
+	log_file_arm(c->lf, c->lf->cur->fd);
+}
+
+static void init_clock(VALUE self, struct clogger *c, VALUE clock)
+{
+	VALUE kind = rb_funcall(self, rb_intern("compile_clock"), 2,
+	                        clock, c->fmt_ops);
+
+	c->mono_clock = hopefully_CLOCK_MONOTONIC;
+	c->real_clock = CLOCK_REALTIME;
+#if defined(CLOCK_MONOTONIC_COARSE) && defined(CLOCK_REALTIME_COARSE)
+	if (kind == ID2SYM(rb_intern("coarse"))) {
+		c->mono_clock = CLOCK_MONOTONIC_COARSE;
+		c->real_clock = CLOCK_REALTIME_COARSE;
+	}
+#endif
+}
+
+static void init_index(struct clogger *c)
+{
+	if (!c->lf || NIL_P(c->lf->path))
+		rb_raise(rb_eArgError, ":index needs a :path");
+	log_file_index(c->lf, rb_funcall(cIndex, open_writer_id, 1,
+	                                 c->lf->path));
+}
+
+static void init_line_buffer(VALUE self, VALUE size, VALUE interval)
+{
+	struct clogger *c = clogger_get(self);
+	long limit = size == Qtrue ? LINE_BUFFER_SIZE : NUM2LONG(size);
+	double sec = NIL_P(interval) ? 1.0 : NUM2DBL(interval);
+
+	if (!c->lf)
+		rb_raise(rb_eArgError, ":buffer needs a :path or a :logger "
+		         "with a file descriptor");
+	if (limit <= 0)
+		rb_raise(rb_eArgError, ":buffer must be positive");
+	if (sec <= 0)
+		rb_raise(rb_eArgError, ":flush_interval must be positive");
+
+	c->lbuf = line_buffer_new(&c->lb, limit, (long)(sec * 1e9));
+	rb_funcall(cClogger, rb_intern("register_buffer"), 2,
+	           self, rb_float_new(sec));
+}
+
+/* only registered for flushing once a fiber logs something */
+static void init_fiber_buffer(struct clogger *c, VALUE interval)
+{
+	double sec = NIL_P(interval) ? 1.0 : NUM2DBL(interval);
+
+	if (sec <= 0)
+		rb_raise(rb_eArgError, ":flush_interval must be positive");
+	c->fbuf = line_buffer_new(&c->fb, LINE_BUFFER_SIZE, (long)(sec * 1e9));
+}
+
+static void init_flight_recorder(VALUE self, struct clogger *c, VALUE opt)
+{
+	VALUE tmp = rb_funcall(self, rb_intern("compile_flight_recorder"), 1, opt);
+
+	c->flight = flight_recorder_new(&c->fr, rb_ary_entry(tmp, 0),
+	                                NUM2ULL(rb_ary_entry(tmp, 1)));
+}
+
+static void init_path_template(VALUE self, struct clogger *c, VALUE o)
+{
+	VALUE pat = Qnil;
+	VALUE size = Qnil;
+	long nr = PATH_TEMPLATE_CACHE;
+
+	if (TYPE(o) == T_HASH) {
+		pat = rb_hash_aref(o, ID2SYM(rb_intern("path_patterns")));
+		size = rb_hash_aref(o, ID2SYM(rb_intern("path_template_cache")));
+	}
+	if (!NIL_P(size)) {
+		nr = NUM2LONG(size);
+		if (nr < 0)
+			rb_raise(rb_eArgError,
+			         ":path_template_cache must not be negative");
+	}
+	pat = rb_funcall(self, rb_intern("compile_path_patterns"), 1, pat);
+	c->pathtpl = path_tpl_new(&c->pt, pat, (unsigned long)nr);
+}
+
+/**
+ * call-seq:
  *   Clogger.new(app, :logger => $stderr, :format => string) => obj
  *
  * Creates a new Clogger object that wraps +app+.  +:logger+ may
  * be any object that responds to the "<<" method with a string argument.
  * Instead of +:logger+, +:path+ may be specified to be a :path of a File
- * that will be opened in append mode.
+ * that will be opened in append mode.  +:if+ is called with the Rack env
+ * and status, and the line is only written if it returns true.
+ *
+ * +:outputs+ takes an Array of Hashes, each with its own +:format+,
+ * +:logger+ or +:path+, +:if+ and +:max_line_length+ options.  Every
+ * output is rendered from a single pass over the request, so each
+ * env, header, cookie or query variable is only looked up and escaped
+ * once no matter how many outputs use it.
  */
 static VALUE clogger_init(int argc, VALUE *argv, VALUE self)
 {
@@ -740,21 +2267,112 @@ static VALUE clogger_init(int argc, VALUE *argv, VALUE self)
 	VALUE fmt = rb_const_get(mFormat, rb_intern("Common"));
 
 	rb_scan_args(argc, argv, "11", &c->app, &o);
-	c->fd = -1;
+	c->logfile = Qnil;
+	c->dedup = Qnil;
 	c->logger = Qnil;
+	c->input = Qnil;
+	c->trusted = Qnil;
+	c->cond = Qnil;
+	c->outputs = Qnil;
+	c->lbuf = Qnil;
+	c->fbuf = Qnil;
+	c->rid_env = Qnil;
+	c->pathtpl = Qnil;
+	c->flight = Qnil;
+	c->max_line = -1;
 	c->reentrant = -1; /* auto-detect */
+	c->stats = clogger_stats_new(&c->st);
 
 	if (TYPE(o) == T_HASH) {
-		VALUE tmp;
+		VALUE tmp, size;
 
 		tmp = rb_hash_aref(o, ID2SYM(rb_intern("path")));
 		c->logger = rb_hash_aref(o, ID2SYM(rb_intern("logger")));
-		init_logger(c, tmp);
+		init_logger(self, c, tmp);
 
 		tmp = rb_hash_aref(o, ID2SYM(rb_intern("format")));
 		if (!NIL_P(tmp))
 			fmt = tmp;
 
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("if")));
+		if (!NIL_P(tmp)) {
+			if (!rb_respond_to(tmp, call_id))
+				rb_raise(rb_eArgError, ":if must respond to call");
+			c->cond = tmp;
+		}
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("outputs")));
+		if (!NIL_P(tmp))
+			c->outputs = rb_funcall(self, rb_intern("compile_outputs"),
+			                        1, o);
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("trusted_proxies")));
+		if (!NIL_P(tmp))
+			c->trusted = cidr_trie_new(tmp);
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("max_line_length")));
+		if (!NIL_P(tmp)) {
+			c->max_line = NUM2LONG(tmp);
+			if (c->max_line <= 0)
+				rb_raise(rb_eArgError,
+				         ":max_line_length must be positive");
+		}
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("index")));
+		if (RTEST(tmp))
+			init_index(c);
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("rotate_size")));
+		size = rb_hash_aref(o, ID2SYM(rb_intern("rotate_interval")));
+		if (!NIL_P(tmp) || !NIL_P(size))
+			init_rotation(c, tmp, size);
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("buffer")));
+		size = rb_hash_aref(o, ID2SYM(rb_intern("flush_interval")));
+		if (RTEST(tmp))
+			init_line_buffer(self, tmp, size);
+		else if (c->lf)
+			init_fiber_buffer(c, size);
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("dedup")));
+		if (RTEST(tmp)) {
+			if (!c->lf && NIL_P(c->logger))
+				rb_raise(rb_eArgError, ":dedup needs a :path "
+				         "or :logger");
+			tmp = rb_funcall(self, rb_intern("compile_dedup"),
+			                 1, tmp);
+			c->dedup = dedup_new(&c->dd, tmp);
+			rb_funcall(cClogger, rb_intern("register_buffer"), 2,
+			           self, rb_funcall(self,
+			           rb_intern("dedup_interval"), 1, tmp));
+		}
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("flight_recorder")));
+		if (RTEST(tmp)) {
+			if (!NIL_P(c->outputs))
+				rb_raise(rb_eArgError, ":flight_recorder goes "
+				         "in one of the :outputs");
+			init_flight_recorder(self, c, tmp);
+		}
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("snapshot")));
+		if (RTEST(tmp)) {
+			if (!NIL_P(c->outputs) || c->dd)
+				rb_raise(rb_eArgError, ":snapshot doesn't work "
+				         "with :outputs or :dedup");
+			c->use_snapshot = 1;
+		}
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("escape")));
+		c->xs_utf8 = RTEST(rb_funcall(self,
+		                   rb_intern("compile_escape"), 1, tmp));
+
+		tmp = rb_hash_aref(o, ID2SYM(rb_intern("request_id")));
+		if (tmp == Qtrue)
+			c->rid_env = rb_obj_freeze(rb_str_new2("clogger.request_id"));
+		else if (RTEST(tmp))
+			c->rid_env = rb_obj_freeze(rb_str_dup(StringValue(tmp)));
+
 		tmp = rb_hash_aref(o, ID2SYM(rb_intern("reentrant")));
 		switch (TYPE(tmp)) {
 		case T_TRUE:
@@ -770,14 +2388,42 @@ static VALUE clogger_init(int argc, VALUE *argv, VALUE self)
 	}
 
 	init_buffers(c);
-	c->fmt_ops = rb_funcall(self, rb_intern("compile_format"), 2, fmt, o);
+	if (NIL_P(c->outputs)) {
+		c->fmt_ops = rb_funcall(self, rb_intern("compile_format"),
+		                        2, fmt, o);
+	} else {
+		long i;
+
+		/* only used to figure out what each request needs */
+		c->fmt_ops = rb_ary_new();
+		for (i = 0; i < RARRAY_LEN(c->outputs); i++) {
+			struct clogger *out;
+
+			out = clogger_get(rb_ary_entry(c->outputs, i));
+			rb_ary_concat(c->fmt_ops, out->fmt_ops);
+			out->stats = c->stats;
+			out->st = c->st;
+		}
+	}
 
 	if (Qtrue == rb_funcall(self, rb_intern("need_response_headers?"),
 	                        1, c->fmt_ops))
 		c->need_resp = 1;
+	if (Qtrue == rb_funcall(self, rb_intern("need_input_counter?"),
+	                        1, c->fmt_ops))
+		c->need_input = 1;
+	if (Qtrue == rb_funcall(self, rb_intern("need_cpu_time?"),
+	                        1, c->fmt_ops))
+		c->need_cpu = 1;
+	if (Qtrue == rb_funcall(self, rb_intern("need_gc_stat?"),
+	                        1, c->fmt_ops))
+		c->need_gc = 1;
 	if (Qtrue == rb_funcall(self, rb_intern("need_wrap_body?"),
 	                        1, c->fmt_ops))
 		c->wrap_body = 1;
+	init_clock(self, c, TYPE(o) == T_HASH ?
+	           rb_hash_aref(o, ID2SYM(rb_intern("clock"))) : Qnil);
+	init_path_template(self, c, o);
 
 	return self;
 }
@@ -787,6 +2433,8 @@ static VALUE body_iter_i(VALUE str, VALUE self)
 	struct clogger *c = clogger_get(self);
 
 	str = rb_obj_as_string(str);
+	if (c->body_bytes_sent == 0)
+		CLOGGER_PROBE1(body__first, RSTRING_LEN(str));
 	c->body_bytes_sent += RSTRING_LEN(str);
 
 	return rb_yield(str);
@@ -834,22 +2482,211 @@ static VALUE clogger_close(VALUE self)
 	return rb_ensure(body_close, self, clogger_write, self);
 }
 
+static void flush_output(struct clogger_stats *st, const struct clogger *o,
+                         int force)
+{
+	if (o->dd)
+		dedup_flush(st, o, force);
+	if (o->lb)
+		lb_flush(st, o->lf, o->lb, 1);
+	if (o->fb)
+		lb_flush(st, o->lf, o->fb, 1);
+}
+
+/**
+ * call-seq:
+ *   clogger.flush(force = true)
+ *
+ * Writes out lines held back by the +:buffer+ and +:dedup+ options,
+ * or logged from fibers under a Fiber.scheduler, including those of
+ * every output in +:outputs+.  Unless +force+ is
+ * true, +:dedup+ summaries are only written for windows which ended.
+ * This happens automatically in the background and at exit.
+ */
+static VALUE clogger_flush(int argc, VALUE *argv, VALUE self)
+{
+	struct clogger *c = clogger_get(self);
+	VALUE force = Qtrue;
+
+	rb_scan_args(argc, argv, "01", &force);
+	if (argc == 0)
+		force = Qtrue;
+	flush_output(c->st, c, RTEST(force));
+	if (!NIL_P(c->outputs)) {
+		long i;
+
+		for (i = 0; i < RARRAY_LEN(c->outputs); i++) {
+			VALUE o = rb_ary_entry(c->outputs, i);
+
+			flush_output(c->st, clogger_get(o), RTEST(force));
+		}
+	}
+	return self;
+}
+
 /* :nodoc: */
 static VALUE clogger_fileno(VALUE self)
 {
 	struct clogger *c = clogger_get(self);
 
-	return c->fd < 0 ? Qnil : INT2NUM(c->fd);
+	return c->lf ? INT2NUM(c->lf->cur->fd) : Qnil;
+}
+
+static void reopen(struct clogger *c)
+{
+	VALUE io;
+
+	if (!c->lf || NIL_P(c->lf->path))
+		return;
+	io = rb_funcall(rb_cFile, rb_intern("open"), 2,
+	                c->lf->path, rb_str_new2("ab"));
+	rb_funcall(io, rb_intern("sync="), 1, Qtrue);
+	rb_funcall(io, rb_intern("autoclose="), 1, Qfalse);
+	log_file_swap(c->lf, NUM2INT(rb_funcall(io, rb_intern("fileno"), 0)));
+	if (!NIL_P(c->lf->index))
+		log_file_index(c->lf, rb_funcall(cIndex, open_writer_id, 1,
+		                                 c->lf->path));
+}
+
+/* :nodoc: reopens our own :path only, for Clogger.reopen_all and #rotate */
+static VALUE clogger_reopen_path(VALUE self)
+{
+	reopen(clogger_get(self));
+	return self;
+}
+
+/* :nodoc: */
+static VALUE clogger_rotate_failed(VALUE self)
+{
+	struct clogger *c = clogger_get(self);
+
+	if (c->lf)
+		log_file_rotate_failed(c->lf);
+	return Qnil;
+}
+
+/**
+ * call-seq:
+ *   clogger.reopen
+ *
+ * Reopens the +:path+ of this Clogger (and each of its +:outputs+),
+ * e.g. after logrotate(8) renamed it.  Writers which already started
+ * finish with the old file, which is closed once the last of them is
+ * done.  Loggers which were not opened via +:path+ are left alone.
+ */
+static VALUE clogger_reopen(VALUE self)
+{
+	struct clogger *c = clogger_get(self);
+
+	reopen(c);
+	if (!NIL_P(c->outputs)) {
+		long i;
+
+		for (i = 0; i < RARRAY_LEN(c->outputs); i++)
+			reopen(clogger_get(rb_ary_entry(c->outputs, i)));
+	}
+	return self;
+}
+
+static void path_template_str(void *dst, const char *ptr, long len)
+{
+	*(VALUE *)dst = rb_str_new(ptr, len);
+}
+
+/**
+ * call-seq:
+ *   clogger.path_template(path)	-> string
+ *
+ * Returns what $path_template logs for a PATH_INFO of +path+, so
+ * other code can aggregate by the same keys.
+ */
+static VALUE clogger_path_template(VALUE self, VALUE path)
+{
+	VALUE rv;
+
+	path_template_do(clogger_get(self)->pt, StringValue(path),
+	                 path_template_str, &rv);
+	return rv;
+}
+
+/**
+ * call-seq:
+ *   clogger.clock	-> :precise or :coarse
+ *
+ * Returns which clocks $request_time and $time are read from, see the
+ * +:clock+ option.
+ */
+static VALUE clogger_clock(VALUE self)
+{
+	struct clogger *c = clogger_get(self);
+
+	if (c->mono_clock == hopefully_CLOCK_MONOTONIC)
+		return ID2SYM(rb_intern("precise"));
+	return ID2SYM(rb_intern("coarse"));
+}
+
+/* :nodoc: */
+static VALUE clogger_log_path(VALUE self)
+{
+	struct clogger *c = clogger_get(self);
+
+	return c->lf ? c->lf->path : Qnil;
+}
+
+/*
+ * requests without CONTENT_LENGTH (chunked) get their rack.input wrapped
+ * so $request_length counts the bytes the app actually consumed
+ */
+static void count_input(struct clogger *c, VALUE env)
+{
+	VALUE tmp = rb_hash_aref(env, g_CONTENT_LENGTH);
+
+	if (TYPE(tmp) == T_STRING && RSTRING_LEN(tmp) != 0)
+		return;
+
+	tmp = rb_hash_aref(env, g_rack_input);
+	if (NIL_P(tmp))
+		return;
+
+	c->input = rb_funcall(cInputCounter, new_id, 1, tmp);
+	rb_hash_aset(env, g_rack_input, c->input);
+}
+
+/* these are all native counters, no Ruby objects are allocated */
+static void rusage_start(struct clogger *c)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	if (c->need_cpu)
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c->cpu_start);
+#endif
+	if (c->need_gc) {
+		c->gc_count_start = rb_gc_count();
+		if (sym_gc_time != Qfalse)
+			c->gc_time_start = rb_gc_stat(sym_gc_time);
+		c->alloc_start = rb_gc_stat(sym_total_allocated_objects);
+	}
 }
 
 static VALUE ccall(struct clogger *c, VALUE env)
 {
 	VALUE rv;
 
-	clock_gettime(hopefully_CLOCK_MONOTONIC, &c->ts_start);
+	CLOGGER_PROBE(request__start);
+	clock_gettime(c->mono_clock, &c->ts_start);
+	rusage_start(c);
 	c->env = env;
 	c->cookies = Qfalse;
+	c->input = Qnil;
+	c->rid_len = 0;
+	if (!NIL_P(c->rid_env)) {
+		pick_request_id(c);
+		rb_hash_aset(env, c->rid_env, rb_str_new(c->rid, c->rid_len));
+	}
+	if (c->need_input)
+		count_input(c, env);
 	rv = rb_funcall(c->app, call_id, 1, env);
+	CLOGGER_PROBE1(app__return, TYPE(rv) == T_ARRAY && RARRAY_LEN(rv) == 3 ?
+	               probe_status(rb_ary_entry(rv, 0)) : 0);
 	if (TYPE(rv) == T_ARRAY && RARRAY_LEN(rv) == 3) {
 		c->status = rb_ary_entry(rv, 0);
 		c->headers = rb_ary_entry(rv, 1);
@@ -1010,6 +2847,34 @@ static VALUE to_path(VALUE self)
 	return path;
 }
 
+/*
+ * call-seq:
+ *   clogger.stats => hash
+ *
+ * Returns counters describing the cost of logging for this Clogger
+ * (including its reentrant copies): lines and bytes written, write(2)
+ * calls, short writes, EINTR/EAGAIN retries, lines written via a
+ * +:logger+ object, time spent formatting and writing (totals and
+ * maximums, in seconds), and the log buffer high-water mark.
+ */
+static VALUE clogger_stats(VALUE self)
+{
+	struct clogger *c = clogger_get(self);
+
+	return NIL_P(c->stats) ? Qnil : stats_hash(c->st);
+}
+
+/*
+ * call-seq:
+ *   Clogger.stats => hash
+ *
+ * Like Clogger#stats, but aggregated across every Clogger in the process.
+ */
+static VALUE clogger_s_stats(VALUE klass)
+{
+	return stats_hash(&g_stats);
+}
+
 /* :nodoc: */
 static VALUE body(VALUE self)
 {
@@ -1031,11 +2896,16 @@ void Init_clogger_ext(void)
 	close_id = rb_intern("close");
 	to_i_id = rb_intern("to_i");
 	to_s_id = rb_intern("to_s");
-	size_id = rb_intern("size");
 	sq_brace_id = rb_intern("[]");
 	new_id = rb_intern("new");
 	to_path_id = rb_intern("to_path");
 	respond_to_id = rb_intern("respond_to?");
+	bytes_read_id = rb_intern("bytes_read");
+	start_flusher_id = rb_intern("start_flusher");
+	flush_soon_id = rb_intern("flush_soon");
+	register_buffer_id = rb_intern("register_buffer");
+	rotate_later_id = rb_intern("rotate_later");
+	open_writer_id = rb_intern("open_writer");
 	cClogger = rb_define_class("Clogger", rb_cObject);
 	mFormat = rb_define_module_under(cClogger, "Format");
 	rb_define_alloc_func(cClogger, clogger_alloc);
@@ -1045,13 +2915,26 @@ void Init_clogger_ext(void)
 	rb_define_method(cClogger, "each", clogger_each, 0);
 	rb_define_method(cClogger, "close", clogger_close, 0);
 	rb_define_method(cClogger, "fileno", clogger_fileno, 0);
+	rb_define_method(cClogger, "flush", clogger_flush, -1);
+	rb_define_method(cClogger, "reopen", clogger_reopen, 0);
+	rb_define_method(cClogger, "clock", clogger_clock, 0);
+	rb_define_method(cClogger, "path_template", clogger_path_template, 1);
+	rb_define_private_method(cClogger, "log_path", clogger_log_path, 0);
+	rb_define_private_method(cClogger, "reopen_path", clogger_reopen_path, 0);
+	rb_define_private_method(cClogger, "rotate_failed",
+	                         clogger_rotate_failed, 0);
 	rb_define_method(cClogger, "wrap_body?", clogger_wrap_body, 0);
 	rb_define_method(cClogger, "reentrant?", clogger_reentrant, 0);
 	rb_define_method(cClogger, "to_path", to_path, 0);
 	rb_define_method(cClogger, "respond_to?", respond_to, -1);
 	rb_define_method(cClogger, "body", body, 0);
+	rb_define_method(cClogger, "stats", clogger_stats, 0);
+	rb_define_singleton_method(cClogger, "stats", clogger_s_stats, 0);
 	CONST_GLOBAL_STR(REMOTE_ADDR);
+	CONST_GLOBAL_STR(CONTENT_LENGTH);
 	CONST_GLOBAL_STR(HTTP_X_FORWARDED_FOR);
+	CONST_GLOBAL_STR(HTTP_X_REQUEST_ID);
+	CONST_GLOBAL_STR(HTTP_COOKIE);
 	CONST_GLOBAL_STR(REQUEST_METHOD);
 	CONST_GLOBAL_STR(PATH_INFO);
 	CONST_GLOBAL_STR(QUERY_STRING);
@@ -1065,9 +2948,21 @@ void Init_clogger_ext(void)
 	CONST_GLOBAL_STR2(question_mark, "?");
 	CONST_GLOBAL_STR2(rack_request_cookie_hash, "rack.request.cookie_hash");
 
+	sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+	sym_gc_time = ID2SYM(rb_intern("time"));
+	tmp = rb_funcall(rb_mGC, rb_intern("stat"), 0);
+	if (NIL_P(rb_hash_aref(tmp, sym_gc_time)))
+		sym_gc_time = Qfalse;
+
 	tmp = rb_const_get(rb_cObject, rb_intern("Rack"));
 	tmp = rb_const_get(tmp, rb_intern("Utils"));
 	cHeaderHash = rb_const_get(tmp, rb_intern("HeaderHash"));
+	cInputCounter = rb_const_get(cClogger, rb_intern("InputCounter"));
+	cIndex = rb_const_get(cClogger, rb_intern("Index"));
+	init_parser(cClogger);
+	init_request_id();
+	init_fr_pid();
+	match_p_id = rb_intern("match?");
 
 	rb_obj_freeze(mark_ary);
 }
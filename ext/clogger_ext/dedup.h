@@ -0,0 +1,131 @@
+/*
+ * :dedup state, one slot per PATH_INFO prefix.  Each slot remembers a
+ * hash of the last line written (minus its time-dependent variables)
+ * and a copy of the latest identical line it suppressed, which is
+ * written out with $repeat_count once the window ends.  Lines longer
+ * than DEDUP_LINE_MAX are never suppressed, so memory use is bounded
+ * by the number of prefixes.  Shared by all reentrant copies and only
+ * touched with the GVL held.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#define DEDUP_LINE_MAX 4096
+
+struct dedup_slot {
+	VALUE prefix;
+	long window_ns;
+	uint64_t hash;
+	int have_hash;
+	unsigned long repeats;
+	struct timespec end; /* of the current window */
+	char line[DEDUP_LINE_MAX]; /* last suppressed line */
+	long line_len;
+	long count_off; /* where $repeat_count goes in +line+, -1: nowhere */
+	long count_len;
+};
+
+struct dedup {
+	long nr;
+	struct dedup_slot *slots;
+};
+
+static void dedup_mark(void *ptr)
+{
+	struct dedup *d = ptr;
+	long i;
+
+	for (i = 0; i < d->nr; i++)
+		rb_gc_mark(d->slots[i].prefix);
+}
+
+static void dedup_free(void *ptr)
+{
+	struct dedup *d = ptr;
+
+	xfree(d->slots);
+	xfree(d);
+}
+
+/* +list+ is [ [ prefix, window_seconds ], ... ] from compile_dedup */
+static VALUE dedup_new(struct dedup **d, VALUE list)
+{
+	VALUE rv = Data_Make_Struct(0, struct dedup, dedup_mark, dedup_free, *d);
+	long i;
+
+	(*d)->slots = ALLOC_N(struct dedup_slot, RARRAY_LEN(list));
+	for (i = 0; i < RARRAY_LEN(list); i++) {
+		struct dedup_slot *s = &(*d)->slots[i];
+		VALUE pair = rb_ary_entry(list, i);
+
+		memset(s, 0, sizeof(*s));
+		s->prefix = rb_ary_entry(pair, 0);
+		s->window_ns = (long)(NUM2DBL(rb_ary_entry(pair, 1)) * 1e9);
+		(*d)->nr = i + 1;
+	}
+	return rv;
+}
+
+static struct dedup_slot *dedup_slot(struct dedup *d, VALUE path)
+{
+	long i;
+
+	if (TYPE(path) != T_STRING)
+		return NULL;
+	for (i = 0; i < d->nr; i++) {
+		VALUE prefix = d->slots[i].prefix;
+		long len = RSTRING_LEN(prefix);
+
+		if (RSTRING_LEN(path) >= len &&
+		    !memcmp(RSTRING_PTR(path), RSTRING_PTR(prefix), len))
+			return &d->slots[i];
+	}
+	return NULL;
+}
+
+/*
+ * a word-at-a-time multiply/xorshift hash, lines are short and this
+ * only needs to tell them apart, not resist attackers
+ */
+#define DEDUP_MUL UINT64_C(0x9e3779b97f4a7c15)
+
+static inline uint64_t dedup_mix(uint64_t h, uint64_t v)
+{
+	h ^= v * DEDUP_MUL;
+	h ^= h >> 29;
+	return h * UINT64_C(0xbf58476d1ce4e5b9);
+}
+
+static uint64_t dedup_hash(uint64_t h, const char *p, long len)
+{
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		h = dedup_mix(h, v);
+	}
+	if (len > 0) {
+		v = 0;
+		memcpy(&v, p, len);
+		h = dedup_mix(h, v ^ ((uint64_t)len << 56));
+	}
+	return h;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static void dedup_arm(struct dedup_slot *s, const struct timespec *now)
+{
+	s->end = *now;
+	s->end.tv_sec += s->window_ns / 1000000000;
+	s->end.tv_nsec += s->window_ns % 1000000000;
+	if (s->end.tv_nsec >= 1000000000) {
+		s->end.tv_sec++;
+		s->end.tv_nsec -= 1000000000;
+	}
+}
@@ -0,0 +1,128 @@
+/*
+ * byte classification for field_xs and snap_xs.  By default, quotes,
+ * control bytes and everything >= 0x7f are escaped as "\xHH".  With
+ * :escape => :utf8, well-formed UTF-8 sequences (except the C1
+ * controls, U+0080-U+009F) pass through unchanged and only stray
+ * bytes >= 0x80 are escaped.  Runs of plain ASCII are skipped 8 bytes
+ * at a time.
+ */
+#include <stdint.h>
+#include <string.h>
+
+static inline int need_escape(unsigned c)
+{
+	assert(c <= 0xff);
+	return !!(c == '\'' || c == '"' || c <= 0x1f || c >= 0x7f);
+}
+
+static const char esc[] = "0123456789ABCDEF";
+
+#define XS_ONES 0x0101010101010101ULL
+#define XS_HIGHS 0x8080808080808080ULL
+
+/* true if any byte of +v+ is zero, no false positives */
+#define XS_HASZERO(v) (((v) - XS_ONES) & ~(v) & XS_HIGHS)
+
+/* true if any byte of +v+ would need_escape(), no false positives */
+static inline uint64_t xs_word_special(uint64_t v)
+{
+	return (v & XS_HIGHS) | /* >= 0x80 */
+	       ((v - XS_ONES * 0x20) & ~v & XS_HIGHS) | /* < 0x20 */
+	       XS_HASZERO(v ^ (XS_ONES * 0x7f)) |
+	       XS_HASZERO(v ^ (XS_ONES * '"')) |
+	       XS_HASZERO(v ^ (XS_ONES * '\''));
+}
+
+/* length of the well-formed UTF-8 sequence at +p+, 0 if there's none */
+static long utf8_seq_len(const unsigned char *p, const unsigned char *end)
+{
+	unsigned lead = p[0];
+	unsigned lo = 0x80, hi = 0xbf; /* range of the second byte */
+	long n, i;
+
+	if (lead < 0xc2)
+		return 0; /* ASCII, continuation or overlong */
+	if (lead < 0xe0) {
+		n = 2;
+		if (lead == 0xc2)
+			lo = 0xa0; /* skip C1 controls */
+	} else if (lead < 0xf0) {
+		n = 3;
+		if (lead == 0xe0)
+			lo = 0xa0; /* overlong */
+		else if (lead == 0xed)
+			hi = 0x9f; /* surrogates */
+	} else if (lead < 0xf5) {
+		n = 4;
+		if (lead == 0xf0)
+			lo = 0x90; /* overlong */
+		else if (lead == 0xf4)
+			hi = 0x8f; /* > U+10FFFF */
+	} else {
+		return 0;
+	}
+	if (end - p < n || p[1] < lo || p[1] > hi)
+		return 0;
+	for (i = 2; i < n; i++)
+		if (p[i] < 0x80 || p[i] > 0xbf)
+			return 0;
+	return n;
+}
+
+/* how many bytes from +p+ on may be logged as-is */
+static long xs_run(const unsigned char *p, const unsigned char *end, int utf8)
+{
+	const unsigned char *start = p;
+
+	while (p < end) {
+		uint64_t v;
+		long n;
+
+		if (end - p >= 8) {
+			memcpy(&v, p, 8);
+			if (!xs_word_special(v)) {
+				p += 8;
+				continue;
+			}
+		}
+		if (!need_escape(*p))
+			p++;
+		else if (utf8 && *p >= 0x80 && (n = utf8_seq_len(p, end)))
+			p += n;
+		else
+			break;
+	}
+	return p - start;
+}
+
+/*
+ * returns how much of +p+ (+n+ bytes) to keep so truncation doesn't
+ * leave part of a passed-through UTF-8 sequence behind.  Only whole,
+ * well-formed sequences make it into lines, so the last lead byte
+ * tells how long its sequence should be.
+ */
+static long utf8_trim(const char *p, long n, long floor)
+{
+	long i = n;
+	unsigned lead;
+
+	while (i > floor && i > n - 4 && ((unsigned char)p[i - 1] & 0xc0) == 0x80)
+		i--;
+	if (i == floor || ((unsigned char)p[i - 1]) < 0xc0)
+		return n;
+	lead = (unsigned char)p[i - 1];
+	if (n - (i - 1) < (lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2))
+		return i - 1;
+	return n;
+}
+
+/* for unescaping "%XX" and "\xHH" */
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
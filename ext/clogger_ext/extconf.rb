@@ -19,9 +19,16 @@ begin
   have_func('gmtime_r', 'time.h') or raise "gmtime_r needed"
   have_struct_member('struct tm', 'tm_gmtoff', 'time.h')
   have_func('rb_str_set_len', 'ruby.h')
+  have_func('rb_gc_count', 'ruby.h') or raise "rb_gc_count needed"
+  have_func('rb_gc_stat', 'ruby.h') or raise "rb_gc_stat needed"
+  have_header('sys/sdt.h') # optional USDT probes
+  have_header('pthread.h') # parallel Clogger::Parser#tally
   have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
   have_func('rb_thread_blocking_region', 'ruby.h')
   have_func('rb_thread_io_blocking_region', 'ruby.h')
+  if have_header('ruby/fiber/scheduler.h') # Ruby 3.0+
+    have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+  end
   create_makefile('clogger_ext')
 rescue Object => err
   warn "E: #{err.inspect}"
@@ -0,0 +1,120 @@
+/*
+ * :flight_recorder, a ring of the last N requests in a MAP_SHARED file
+ * for Clogger::FlightRecorder and bin/clogger-top to read while we run.
+ * The layout is in lib/clogger/flight_recorder.rb, which also creates
+ * the file.  Any number of threads and processes may write: each
+ * record claims a sequence number with an atomic increment of the
+ * header's head and is written seqlock-style, with the slot's seq odd
+ * while the payload is being copied, so readers can tell torn slots.
+ * Nothing here ever blocks or takes a lock.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#define FR_HEADER_SIZE 64
+#define FR_HEAD_OFF 24
+#define FR_SLOT_SIZE 512
+
+struct fr_slot {
+	uint64_t seq; /* n * 2 + 2 for record n, odd while writing */
+	int64_t time_ns; /* since the Epoch */
+	uint64_t request_time_ns;
+	uint32_t pid;
+	uint16_t status;
+	uint16_t len;
+	char line[FR_SLOT_SIZE - 32];
+};
+
+struct flight_recorder {
+	char *base;
+	size_t len;
+	uint64_t entries;
+	uint64_t *head;
+};
+
+#if defined(__GNUC__) && defined(__ATOMIC_RELAXED)
+#  define FR_ATOMICS 1
+#endif
+
+#ifdef HAVE_PTHREAD_H
+static pid_t fr_pid;
+
+static void fr_atfork_child(void)
+{
+	fr_pid = 0;
+}
+#  define FR_PID() (fr_pid ? fr_pid : (fr_pid = getpid()))
+#else
+#  define FR_PID() getpid()
+#endif
+
+static void flight_recorder_free(void *ptr)
+{
+	struct flight_recorder *fr = ptr;
+
+	if (fr->base)
+		munmap(fr->base, fr->len);
+	xfree(fr);
+}
+
+/* maps +io+ from Clogger::FlightRecorder.open_writer */
+static VALUE
+flight_recorder_new(struct flight_recorder **fr, VALUE io, uint64_t entries)
+{
+	VALUE rv = Data_Make_Struct(0, struct flight_recorder, NULL,
+	                            flight_recorder_free, *fr);
+	size_t len = FR_HEADER_SIZE + entries * FR_SLOT_SIZE;
+	int fd = NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+	void *base;
+
+#ifndef FR_ATOMICS
+	rb_raise(rb_eNotImpError, ":flight_recorder needs __atomic builtins");
+#endif
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		rb_sys_fail("mmap");
+	rb_funcall(io, rb_intern("close"), 0); /* the mapping stays */
+	(*fr)->base = base;
+	(*fr)->len = len;
+	(*fr)->entries = entries;
+	(*fr)->head = (uint64_t *)((*fr)->base + FR_HEAD_OFF);
+	return rv;
+}
+
+/* +line+ is stored without its trailing newline, cut to fit the slot */
+static void fr_put(struct flight_recorder *fr, int64_t time_ns,
+                   uint64_t request_time_ns, int status,
+                   const char *line, long len)
+{
+#ifdef FR_ATOMICS
+	uint64_t n = __atomic_fetch_add(fr->head, 1, __ATOMIC_RELAXED);
+	struct fr_slot *s = (struct fr_slot *)(fr->base + FR_HEADER_SIZE +
+	                                      (n % fr->entries) * FR_SLOT_SIZE);
+
+	if (len > 0 && line[len - 1] == '\n')
+		len--;
+	if (len > (long)sizeof(s->line))
+		len = sizeof(s->line);
+
+	__atomic_store_n(&s->seq, n * 2 + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->time_ns = time_ns;
+	s->request_time_ns = request_time_ns;
+	s->pid = (uint32_t)FR_PID();
+	s->status = (uint16_t)status;
+	s->len = (uint16_t)len;
+	memcpy(s->line, line, len);
+	__atomic_store_n(&s->seq, n * 2 + 2, __ATOMIC_RELEASE);
+#endif /* FR_ATOMICS */
+}
+
+static void init_fr_pid(void)
+{
+#ifdef HAVE_PTHREAD_H
+	(void)pthread_atfork(NULL, NULL, fr_atfork_child);
+#endif
+}
@@ -0,0 +1,100 @@
+/*
+ * pending lines for :buffer.  Lines are appended with the GVL held, so
+ * they stay in the order they were logged across all threads, and they
+ * are written out in large chunks with the GVL released.  Only one
+ * chunk is in flight at a time, so chunks can't be reordered, either.
+ * Shared by all reentrant copies.  Unbuffered descriptors get one, too,
+ * for lines logged from fibers under a Fiber.scheduler; those are only
+ * ever written out by the background flusher.
+ */
+#include <string.h>
+
+struct line_buffer {
+	char *ptr; /* lines being appended to */
+	size_t len;
+	size_t capa;
+	char *spare; /* NULL while it is being written out */
+	size_t spare_capa;
+	size_t limit; /* flush once this many bytes are pending */
+	long interval_ns; /* flush once the oldest line is this old */
+	struct timespec deadline;
+	pid_t pid; /* lines inherited across fork belong to the parent */
+	int flushing;
+	int registered; /* with Clogger.register_buffer, for fiber buffers */
+};
+
+static void line_buffer_free(void *ptr)
+{
+	struct line_buffer *lb = ptr;
+
+	xfree(lb->ptr);
+	xfree(lb->spare);
+	xfree(lb);
+}
+
+static VALUE
+line_buffer_new(struct line_buffer **lb, size_t limit, long interval_ns)
+{
+	VALUE rv = Data_Make_Struct(0, struct line_buffer,
+	                            NULL, line_buffer_free, *lb);
+
+	(*lb)->limit = limit;
+	(*lb)->interval_ns = interval_ns;
+	return rv;
+}
+
+/* returns true if +lb+ was empty beforehand */
+static int line_buffer_cat(struct line_buffer *lb, const char *ptr, size_t len)
+{
+	int was_empty = lb->len == 0;
+	pid_t pid = getpid();
+
+	if (lb->pid != pid) {
+		lb->pid = pid;
+		lb->len = 0;
+		lb->flushing = 0; /* that thread didn't survive fork */
+		was_empty = 1;
+
+		/*
+		 * if it was writing when we forked, it owned the other
+		 * buffer and took it along, so start over from nothing
+		 */
+		if (!lb->ptr)
+			lb->capa = 0;
+		if (!lb->spare)
+			lb->spare_capa = 0;
+	}
+	if (lb->len + len > lb->capa) {
+		size_t capa = lb->capa ? lb->capa : lb->limit;
+
+		while (capa < lb->len + len)
+			capa *= 2;
+		REALLOC_N(lb->ptr, char, capa);
+		lb->capa = capa;
+	}
+	memcpy(lb->ptr + lb->len, ptr, len);
+	lb->len += len;
+
+	return was_empty;
+}
+
+static int line_buffer_due(const struct line_buffer *lb,
+                           const struct timespec *now)
+{
+	if (lb->len >= lb->limit)
+		return 1;
+	if (now->tv_sec != lb->deadline.tv_sec)
+		return now->tv_sec > lb->deadline.tv_sec;
+	return now->tv_nsec >= lb->deadline.tv_nsec;
+}
+
+static void line_buffer_arm(struct line_buffer *lb, const struct timespec *now)
+{
+	lb->deadline = *now;
+	lb->deadline.tv_sec += lb->interval_ns / 1000000000;
+	lb->deadline.tv_nsec += lb->interval_ns % 1000000000;
+	if (lb->deadline.tv_nsec >= 1000000000) {
+		lb->deadline.tv_sec++;
+		lb->deadline.tv_nsec -= 1000000000;
+	}
+}
@@ -0,0 +1,205 @@
+/*
+ * the descriptor we write(2) to, shared by all reentrant copies.  For
+ * :path, reopening (or rotating) publishes a new descriptor by swapping
+ * +cur+; the old one is only closed once the last writer using it (which
+ * may be in write(2) without the GVL) drops its reference.  All fields
+ * are only touched with the GVL held, so there's no locking.
+ */
+#define LOG_FILE_RETRY 60 /* seconds before retrying a failed rotation */
+
+struct log_fd {
+	int fd;
+	int retired;
+	long refs;
+};
+
+struct log_file {
+	struct log_fd *cur;
+	VALUE path; /* nil unless we opened it ourselves */
+	VALUE owner; /* the Clogger to reopen */
+	off_t size; /* for :rotate_size, including other processes' lines */
+	time_t size_sec; /* when +size+ was last checked with fstat */
+	off_t rotate_size; /* 0: never */
+	long rotate_interval; /* seconds, 0: never */
+	time_t rotate_at;
+	int rotating; /* waiting for the rotator thread */
+	time_t retry_at; /* after a failed rotation */
+	VALUE index; /* :index sidecar IO, nil without one */
+	int index_fd;
+	time_t index_sec; /* of the last record we appended */
+	off_t end; /* bytes logged, including ones still in a :buffer */
+	uint64_t lines; /* lines logged, only counted with an :index */
+};
+
+static struct log_fd *log_fd_new(int fd)
+{
+	struct log_fd *f = ALLOC(struct log_fd);
+
+	f->fd = fd;
+	f->retired = 0;
+	f->refs = 0;
+	return f;
+}
+
+static struct log_fd *log_fd_get(struct log_file *lf)
+{
+	struct log_fd *f = lf->cur;
+
+	f->refs++;
+	return f;
+}
+
+static void log_fd_put(struct log_fd *f)
+{
+	if (--f->refs == 0 && f->retired) {
+		(void)close(f->fd);
+		xfree(f);
+	}
+}
+
+static void log_file_mark(void *ptr)
+{
+	struct log_file *lf = ptr;
+
+	rb_gc_mark(lf->path);
+	rb_gc_mark(lf->owner);
+	rb_gc_mark(lf->index);
+}
+
+static void log_file_free(void *ptr)
+{
+	struct log_file *lf = ptr;
+
+	/* nobody can be writing, they'd be holding onto our owner */
+	if (!NIL_P(lf->path))
+		(void)close(lf->cur->fd);
+	xfree(lf->cur);
+	xfree(lf);
+}
+
+static void log_file_arm(struct log_file *lf, int fd)
+{
+	struct stat sb;
+
+	lf->size = fstat(fd, &sb) == 0 ? sb.st_size : 0;
+	lf->end = lf->size;
+	lf->size_sec = time(NULL);
+	if (lf->rotate_interval) {
+		time_t now = time(NULL);
+
+		lf->rotate_at = now - now % lf->rotate_interval +
+		                lf->rotate_interval;
+	}
+	lf->rotating = 0;
+	lf->retry_at = 0;
+}
+
+static VALUE
+log_file_new(struct log_file **lf, int fd, VALUE path, VALUE owner)
+{
+	VALUE rv = Data_Make_Struct(0, struct log_file,
+	                            log_file_mark, log_file_free, *lf);
+
+	(*lf)->cur = log_fd_new(fd);
+	(*lf)->path = path;
+	(*lf)->owner = owner;
+	(*lf)->index = Qnil;
+	(*lf)->index_fd = -1;
+	log_file_arm(*lf, fd);
+	return rv;
+}
+
+/* publishes +fd+, in-flight writers keep using the old one */
+static void log_file_swap(struct log_file *lf, int fd)
+{
+	struct log_fd *old = lf->cur;
+
+	lf->cur = log_fd_new(fd);
+	log_file_arm(lf, fd);
+	old->retired = 1;
+	old->refs++;
+	log_fd_put(old);
+}
+
+/*
+ * preforked workers may share the file, so +size+ catches up with
+ * theirs once a second.  Each may decide it's due, Clogger#rotate
+ * makes sure only the first one renames it.
+ */
+static int log_file_due(struct log_file *lf)
+{
+	time_t now;
+
+	if (lf->rotating || (!lf->rotate_size && !lf->rotate_interval))
+		return 0;
+	now = time(NULL);
+	if (now < lf->retry_at)
+		return 0;
+	if (lf->rotate_size) {
+		if (now != lf->size_sec) {
+			struct stat sb;
+
+			if (fstat(lf->cur->fd, &sb) == 0 && sb.st_size > lf->size)
+				lf->size = sb.st_size;
+			lf->size_sec = now;
+		}
+		if (lf->size >= lf->rotate_size)
+			return 1;
+	}
+	return lf->rotate_interval && now >= lf->rotate_at;
+}
+
+/* a failed rotation is retried later instead of never */
+static void log_file_rotate_failed(struct log_file *lf)
+{
+	lf->rotating = 0;
+	lf->retry_at = time(NULL) + LOG_FILE_RETRY;
+}
+
+/* +pair+ is [ io, lines ] from Clogger::Index.open_writer */
+static void log_file_index(struct log_file *lf, VALUE pair)
+{
+	VALUE io = rb_ary_entry(pair, 0);
+
+	if (!NIL_P(lf->index))
+		rb_funcall(lf->index, rb_intern("close"), 0);
+	lf->index = io;
+	lf->index_fd = NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+	lf->index_sec = 0;
+	lf->lines = NUM2ULL(rb_ary_entry(pair, 1));
+}
+
+static void put_le64(char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (char)(v >> (i * 8));
+}
+
+/*
+ * called before each line of +len+ bytes is logged.  The first line
+ * each second gets an index record of ( second, offset, lines before
+ * it ).  Other processes may be appending to the same file, so the
+ * offset is wherever the file ends if that's past what we've logged.
+ */
+static void log_file_note(struct log_file *lf, long len)
+{
+	time_t now = time(NULL);
+
+	if (now > lf->index_sec) {
+		off_t end = lseek(lf->cur->fd, 0, SEEK_END);
+		char rec[24];
+
+		if (end < lf->end)
+			end = lf->end;
+		put_le64(rec, (uint64_t)now);
+		put_le64(rec + 8, (uint64_t)end);
+		put_le64(rec + 16, lf->lines);
+		/* best effort, O_APPEND keeps small writes whole */
+		(void)write(lf->index_fd, rec, sizeof(rec));
+		lf->index_sec = now;
+	}
+	lf->end += len;
+	lf->lines++;
+}
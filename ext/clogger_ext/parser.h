@@ -0,0 +1,595 @@
+/*
+ * Clogger::Parser, reads logs back with the layout compiled from their
+ * format.  Files are mmap-ed, literals are found with memchr(3) on their
+ * first byte (vectorized by any libc worth using) and fields are only
+ * copied into Ruby Strings when they're handed to Ruby.  #tally splits
+ * the file into chunks on line boundaries and scans them in parallel
+ * with the GVL released; each thread counts into its own table with
+ * keys pointing into the mapping, and the tables are merged at the end.
+ */
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#define TALLY_CHUNK_MIN (256 * 1024) /* not worth a thread if smaller */
+#define TALLY_THREADS_MAX 64
+
+/*
+ * a private copy of @literals, usable without the GVL.  Built on first
+ * use and kept in a hidden ivar, so it's not rebuilt for every line.
+ */
+struct layout {
+	long nr; /* variables, there are nr + 1 literals */
+	long *lit_len;
+	char **lit;
+};
+
+struct span {
+	long off;
+	long len;
+};
+
+static void layout_free(struct layout *l)
+{
+	long i;
+
+	if (!l)
+		return;
+	if (l->lit)
+		for (i = 0; i <= l->nr; i++)
+			xfree(l->lit[i]);
+	xfree(l->lit);
+	xfree(l->lit_len);
+	xfree(l);
+}
+
+static ID layout_id;
+
+static VALUE layout_new(VALUE self, struct layout **lp)
+{
+	VALUE lits = rb_ivar_get(self, rb_intern("@literals"));
+	VALUE rv;
+	struct layout *l;
+	long i;
+
+	Check_Type(lits, T_ARRAY);
+	rv = Data_Make_Struct(0, struct layout, NULL, layout_free, l);
+	l->nr = RARRAY_LEN(lits) - 1;
+	l->lit_len = ALLOC_N(long, l->nr + 1);
+	l->lit = ZALLOC_N(char *, l->nr + 1);
+	for (i = 0; i <= l->nr; i++) {
+		VALUE s = rb_ary_entry(lits, i);
+
+		StringValue(s);
+		l->lit_len[i] = RSTRING_LEN(s);
+		l->lit[i] = ALLOC_N(char, l->lit_len[i] + 1);
+		memcpy(l->lit[i], RSTRING_PTR(s), l->lit_len[i]);
+	}
+	*lp = l;
+	return rv;
+}
+
+/*
+ * returns the layout of +self+, keep the returned object (which owns
+ * *lp) reachable while using it: a frozen Parser gets a fresh one
+ */
+static VALUE parser_layout(VALUE self, struct layout **lp)
+{
+	VALUE rv = rb_attr_get(self, layout_id);
+
+	if (NIL_P(rv)) {
+		rv = layout_new(self, lp);
+		if (!OBJ_FROZEN(self))
+			rb_ivar_set(self, layout_id, rv);
+	} else {
+		Data_Get_Struct(rv, struct layout, *lp);
+	}
+	return rv;
+}
+
+static const char *
+lit_find(const char *p, const char *end, const char *lit, long len)
+{
+	while (end - p >= len) {
+		p = memchr(p, lit[0], end - p - len + 1);
+		if (!p)
+			return NULL;
+		if (!memcmp(p, lit, len))
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/*
+ * splits the line at [p, p + len) into +sp+.  Each variable ends at
+ * the first occurrence of the literal after it, except the last one
+ * which runs up to the trailing literal.  Returns false if the line
+ * doesn't fit the layout.
+ */
+static int layout_split(const struct layout *l, const char *p, long len,
+                        struct span *sp)
+{
+	const char *end = p + len;
+	const char *cur = p + l->lit_len[0];
+	long i, tail;
+
+	if (len < l->lit_len[0] || memcmp(p, l->lit[0], l->lit_len[0]))
+		return 0;
+	if (l->nr == 0)
+		return cur == end;
+	for (i = 0; i < l->nr - 1; i++) {
+		const char *q = lit_find(cur, end, l->lit[i + 1],
+		                         l->lit_len[i + 1]);
+
+		if (!q)
+			return 0;
+		sp[i].off = cur - p;
+		sp[i].len = q - cur;
+		cur = q + l->lit_len[i + 1];
+	}
+	tail = l->lit_len[l->nr];
+	if (end - cur < tail || memcmp(end - tail, l->lit[l->nr], tail))
+		return 0;
+	sp[i].off = cur - p;
+	sp[i].len = end - tail - cur;
+	return 1;
+}
+
+/* returns the length of the line at +p+, +next+ is set past its "\n" */
+static long next_line(const char *p, const char *end, const char **next)
+{
+	const char *nl = memchr(p, '\n', end - p);
+
+	if (nl) {
+		*next = nl + 1;
+		return nl - p;
+	}
+	*next = end;
+	return end - p;
+}
+
+struct mapping {
+	char *ptr;
+	size_t len;
+};
+
+static void mapping_open(struct mapping *m, VALUE path)
+{
+	struct stat sb;
+	int fd;
+
+	FilePathValue(path);
+	fd = open(StringValueCStr(path), O_RDONLY);
+	if (fd < 0)
+		rb_sys_fail(RSTRING_PTR(path));
+	if (fstat(fd, &sb) < 0) {
+		int err = errno;
+
+		(void)close(fd);
+		errno = err;
+		rb_sys_fail(RSTRING_PTR(path));
+	}
+	m->ptr = NULL;
+	m->len = (size_t)sb.st_size;
+	if (m->len > 0) {
+		void *ptr = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (ptr == MAP_FAILED) {
+			int err = errno;
+
+			(void)close(fd);
+			errno = err;
+			rb_sys_fail(RSTRING_PTR(path));
+		}
+		m->ptr = ptr;
+#ifdef POSIX_MADV_SEQUENTIAL
+		(void)posix_madvise(ptr, m->len, POSIX_MADV_SEQUENTIAL);
+#endif
+	}
+	(void)close(fd);
+}
+
+static void mapping_close(struct mapping *m)
+{
+	if (m->ptr)
+		(void)munmap(m->ptr, m->len);
+	m->ptr = NULL;
+}
+
+static VALUE spans_ary(const char *p, const struct span *sp, long nr)
+{
+	VALUE rv = rb_ary_new2(nr);
+	long i;
+
+	for (i = 0; i < nr; i++)
+		rb_ary_push(rv, rb_str_new(p + sp[i].off, sp[i].len));
+	return rv;
+}
+
+/*
+ * call-seq:
+ *   parser.parse_line(line)	-> [ field, ... ] or nil
+ *
+ * Splits a single logged line into its (still escaped) fields, or
+ * returns nil if it doesn't fit the format.
+ */
+static VALUE parser_parse_line(VALUE self, VALUE line)
+{
+	struct layout *l;
+	struct span *sp;
+	const char *p;
+	long len;
+	VALUE rv = Qnil;
+	VALUE lobj;
+
+	StringValue(line);
+	p = RSTRING_PTR(line);
+	len = RSTRING_LEN(line);
+	if (len > 0 && p[len - 1] == '\n')
+		len--;
+
+	lobj = parser_layout(self, &l);
+	sp = ALLOCA_N(struct span, l->nr + 1);
+	if (layout_split(l, p, len, sp))
+		rv = spans_ary(p, sp, l->nr);
+	RB_GC_GUARD(lobj);
+
+	return rv;
+}
+
+struct parse_each {
+	VALUE self;
+	VALUE lobj; /* owns l */
+	struct layout *l;
+	struct span *sp;
+	struct mapping m;
+};
+
+static VALUE parse_each_i(VALUE p)
+{
+	struct parse_each *a = (struct parse_each *)p;
+	const char *cur = a->m.ptr;
+	const char *end = cur + a->m.len;
+
+	while (cur < end) {
+		const char *line = cur;
+		long len = next_line(cur, end, &cur);
+
+		if (layout_split(a->l, line, len, a->sp))
+			rb_yield(spans_ary(line, a->sp, a->l->nr));
+	}
+	return a->self;
+}
+
+static VALUE parse_each_done(VALUE p)
+{
+	struct parse_each *a = (struct parse_each *)p;
+
+	mapping_close(&a->m);
+	xfree(a->sp);
+	RB_GC_GUARD(a->lobj);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   parser.each(path) { |fields| ... }	-> parser
+ *
+ * Yields the (still escaped) fields of every line in +path+ which fits
+ * the format, other lines are skipped.
+ */
+static VALUE parser_each(VALUE self, VALUE path)
+{
+	struct parse_each a;
+
+	RETURN_ENUMERATOR(self, 1, &path);
+	a.self = self;
+	a.m.ptr = NULL;
+	a.lobj = parser_layout(self, &a.l);
+	a.sp = ALLOC_N(struct span, a.l->nr + 1);
+	mapping_open(&a.m, path);
+
+	return rb_ensure(parse_each_i, (VALUE)&a, parse_each_done, (VALUE)&a);
+}
+
+struct tally_entry {
+	const char *ptr; /* NULL: unused */
+	long len;
+	uint64_t hash;
+	unsigned long count;
+};
+
+struct tally_job {
+	const struct layout *l;
+	long idx;
+	const char *beg;
+	const char *end;
+	volatile int *stop;
+	struct tally_entry *tbl; /* malloc-ed, we don't hold the GVL */
+	unsigned long mask;
+	unsigned long used;
+	int enomem;
+};
+
+static int tally_grow(struct tally_job *j)
+{
+	unsigned long size = j->tbl ? (j->mask + 1) * 2 : 1024;
+	struct tally_entry *tbl = calloc(size, sizeof(struct tally_entry));
+	unsigned long i;
+
+	if (!tbl)
+		return 0;
+	if (j->tbl) {
+		for (i = 0; i <= j->mask; i++) {
+			struct tally_entry *e = &j->tbl[i];
+			unsigned long k = e->hash & (size - 1);
+
+			if (!e->ptr)
+				continue;
+			while (tbl[k].ptr)
+				k = (k + 1) & (size - 1);
+			tbl[k] = *e;
+		}
+		free(j->tbl);
+	}
+	j->tbl = tbl;
+	j->mask = size - 1;
+	return 1;
+}
+
+static int tally_add(struct tally_job *j, const char *p, long len)
+{
+	uint64_t h = dedup_hash(0, p, len);
+	unsigned long k = h & j->mask;
+	struct tally_entry *e;
+
+	for (;; k = (k + 1) & j->mask) {
+		e = &j->tbl[k];
+		if (!e->ptr)
+			break;
+		if (e->hash == h && e->len == len && !memcmp(e->ptr, p, len)) {
+			e->count++;
+			return 1;
+		}
+	}
+	e->ptr = p;
+	e->len = len;
+	e->hash = h;
+	e->count = 1;
+	if (++j->used * 2 > j->mask)
+		return tally_grow(j);
+	return 1;
+}
+
+static void *tally_run(void *p)
+{
+	struct tally_job *j = p;
+	struct span *sp = malloc(sizeof(struct span) * (j->l->nr + 1));
+	const char *cur = j->beg;
+	unsigned long n = 0;
+
+	if (!sp || !tally_grow(j)) {
+		j->enomem = 1;
+		free(sp);
+		return NULL;
+	}
+	while (cur < j->end) {
+		const char *line = cur;
+		long len = next_line(cur, j->end, &cur);
+
+		if ((++n & 4095) == 0 && *j->stop)
+			break;
+		if (!layout_split(j->l, line, len, sp))
+			continue;
+		if (!tally_add(j, line + sp[j->idx].off, sp[j->idx].len)) {
+			j->enomem = 1;
+			break;
+		}
+	}
+	free(sp);
+	return NULL;
+}
+
+struct tally {
+	VALUE self;
+	VALUE lobj; /* owns l */
+	struct layout *l;
+	struct mapping m;
+	struct tally_job *jobs;
+	long nr_jobs;
+	volatile int stop;
+};
+
+static void *tally_jobs(void *p)
+{
+	struct tally *t = p;
+	long i;
+#ifdef HAVE_PTHREAD_H
+	pthread_t *thr = malloc(sizeof(pthread_t) * t->nr_jobs);
+	int *started = calloc(t->nr_jobs, sizeof(int));
+
+	/* the first chunk is ours */
+	for (i = 1; thr && started && i < t->nr_jobs; i++)
+		started[i] = !pthread_create(&thr[i], NULL,
+		                             tally_run, &t->jobs[i]);
+	tally_run(&t->jobs[0]);
+	for (i = 1; i < t->nr_jobs; i++) {
+		if (thr && started && started[i])
+			(void)pthread_join(thr[i], NULL);
+		else
+			tally_run(&t->jobs[i]);
+	}
+	free(started);
+	free(thr);
+#else
+	for (i = 0; i < t->nr_jobs; i++)
+		tally_run(&t->jobs[i]);
+#endif
+	return NULL;
+}
+
+static void tally_stop(void *p)
+{
+	struct tally *t = p;
+
+	t->stop = 1;
+}
+
+static VALUE tally_i(VALUE p)
+{
+	struct tally *t = (struct tally *)p;
+	VALUE rv = rb_hash_new();
+	long i;
+
+#ifdef WITHOUT_GVL
+	WITHOUT_GVL(tally_jobs, t, tally_stop, t);
+#else
+	tally_jobs(t);
+#endif
+	rb_thread_check_ints();
+
+	for (i = 0; i < t->nr_jobs; i++) {
+		struct tally_job *j = &t->jobs[i];
+		unsigned long k;
+
+		if (j->enomem)
+			rb_memerror();
+		for (k = 0; j->tbl && k <= j->mask; k++) {
+			struct tally_entry *e = &j->tbl[k];
+			VALUE key, cur;
+
+			if (!e->ptr)
+				continue;
+			key = rb_str_new(e->ptr, e->len);
+			cur = rb_hash_lookup2(rv, key, Qnil);
+			rb_hash_aset(rv, key, NIL_P(cur) ? ULONG2NUM(e->count) :
+			             rb_funcall(cur, '+', 1, ULONG2NUM(e->count)));
+		}
+	}
+	return rv;
+}
+
+static VALUE tally_done(VALUE p)
+{
+	struct tally *t = (struct tally *)p;
+	long i;
+
+	for (i = 0; i < t->nr_jobs; i++)
+		free(t->jobs[i].tbl);
+	xfree(t->jobs);
+	mapping_close(&t->m);
+	RB_GC_GUARD(t->lobj);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   parser.tally_index(path, index, threads)	-> { value => count, ... }
+ *
+ * counts the distinct (still escaped) values of variable +index+ in
+ * +path+ using up to +threads+ threads.  Lines which don't fit the
+ * format are skipped.
+ */
+static VALUE parser_tally_index(VALUE self, VALUE path, VALUE idx, VALUE thr)
+{
+	struct tally t;
+	long threads = NUM2LONG(thr);
+	long i;
+	const char *cur;
+
+	t.self = self;
+	t.stop = 0;
+	t.jobs = NULL;
+	t.nr_jobs = 0;
+	t.m.ptr = NULL;
+	t.lobj = parser_layout(self, &t.l);
+	i = NUM2LONG(idx);
+	if (i < 0 || i >= t.l->nr)
+		rb_raise(rb_eArgError, "no variable at %ld", i);
+	mapping_open(&t.m, path);
+
+	if (threads > TALLY_THREADS_MAX)
+		threads = TALLY_THREADS_MAX;
+	if ((size_t)threads > t.m.len / TALLY_CHUNK_MIN)
+		threads = (long)(t.m.len / TALLY_CHUNK_MIN);
+	if (threads < 1)
+		threads = 1;
+
+	t.jobs = ALLOC_N(struct tally_job, threads);
+	memset(t.jobs, 0, sizeof(struct tally_job) * threads);
+	t.nr_jobs = threads;
+	cur = t.m.ptr;
+	for (i = 0; i < threads; i++) {
+		struct tally_job *j = &t.jobs[i];
+		const char *end = t.m.ptr + t.m.len;
+
+		j->l = t.l;
+		j->idx = NUM2LONG(idx);
+		j->stop = &t.stop;
+		j->beg = cur;
+		if (i + 1 < threads) {
+			const char *split = t.m.ptr + t.m.len / threads * (i + 1);
+
+			if (split > cur)
+				next_line(split, end, &end);
+			else
+				end = cur;
+		}
+		j->end = end;
+		cur = end;
+	}
+
+	return rb_ensure(tally_i, (VALUE)&t, tally_done, (VALUE)&t);
+}
+
+/*
+ * call-seq:
+ *   Clogger::Parser.unescape(field)	-> string
+ *
+ * decodes the "\xHH" escapes Clogger writes for quotes and
+ * unprintable bytes.
+ */
+static VALUE parser_s_unescape(VALUE klass, VALUE str)
+{
+	const char *p, *end;
+	char *dst;
+	VALUE rv;
+
+	StringValue(str);
+	p = RSTRING_PTR(str);
+	end = p + RSTRING_LEN(str);
+	if (!memchr(p, '\\', end - p))
+		return rb_str_new(p, end - p);
+
+	rv = rb_str_new(NULL, end - p);
+	dst = RSTRING_PTR(rv);
+	while (p < end) {
+		int hi, lo;
+
+		if (end - p >= 4 && p[0] == '\\' && p[1] == 'x' &&
+		    (hi = hexval(p[2])) >= 0 && (lo = hexval(p[3])) >= 0) {
+			*dst++ = (char)(hi << 4 | lo);
+			p += 4;
+		} else {
+			*dst++ = *p++;
+		}
+	}
+	rb_str_set_len(rv, dst - RSTRING_PTR(rv));
+	return rv;
+}
+
+static void init_parser(VALUE klass)
+{
+	VALUE cParser = rb_const_get(klass, rb_intern("Parser"));
+
+	layout_id = rb_intern("layout"); /* no "@", hidden from Ruby */
+
+	rb_define_method(cParser, "parse_line", parser_parse_line, 1);
+	rb_define_method(cParser, "each", parser_each, 1);
+	rb_define_private_method(cParser, "tally_index", parser_tally_index, 3);
+	rb_define_singleton_method(cParser, "unescape", parser_s_unescape, 1);
+}
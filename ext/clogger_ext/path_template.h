@@ -0,0 +1,218 @@
+/*
+ * $path_template: PATH_INFO with each segment matching one of the
+ * :path_patterns, or made of digits (":id"), shaped like a UUID
+ * (":uuid") or of 8+ hex digits including a decimal one (":hex")
+ * replaced by a placeholder, e.g. "/users/:id/orders/:uuid".  A
+ * direct-mapped memo of recently seen paths saves the work (and the
+ * Regexps) for repeats.  Shared by reentrant copies, GVL only.
+ */
+#include <string.h>
+
+#define PATH_TEMPLATE_CACHE 1024 /* slots, unless :path_template_cache */
+#define PATH_TEMPLATE_MEMO_MAX 4096 /* longer paths aren't memoized */
+
+struct path_tpl_slot {
+	uint64_t hash;
+	char *path; /* NULL while unused */
+	long path_len;
+	char *tpl;
+	long tpl_len;
+};
+
+struct path_tpl {
+	VALUE patterns; /* [ [ Regexp, placeholder ], ... ] */
+	long ph_max; /* longest placeholder */
+	unsigned long nr_slots; /* a power of two, 0: no memo */
+	struct path_tpl_slot *slots;
+};
+
+static ID match_p_id;
+
+static void path_tpl_mark(void *ptr)
+{
+	struct path_tpl *pt = ptr;
+
+	rb_gc_mark(pt->patterns);
+}
+
+static void path_tpl_free(void *ptr)
+{
+	struct path_tpl *pt = ptr;
+	unsigned long i;
+
+	for (i = 0; pt->slots && i < pt->nr_slots; i++) {
+		xfree(pt->slots[i].path);
+		xfree(pt->slots[i].tpl);
+	}
+	xfree(pt->slots);
+	xfree(pt);
+}
+
+/* +patterns+ comes from Clogger#compile_path_patterns */
+static VALUE
+path_tpl_new(struct path_tpl **pt, VALUE patterns, unsigned long nr_slots)
+{
+	VALUE rv = Data_Make_Struct(0, struct path_tpl,
+	                            path_tpl_mark, path_tpl_free, *pt);
+	long i;
+
+	(*pt)->patterns = patterns;
+	(*pt)->ph_max = sizeof(":uuid") - 1;
+	for (i = 0; i < RARRAY_LEN(patterns); i++) {
+		VALUE ph = rb_ary_entry(rb_ary_entry(patterns, i), 1);
+
+		if (RSTRING_LEN(ph) > (*pt)->ph_max)
+			(*pt)->ph_max = RSTRING_LEN(ph);
+	}
+	if (nr_slots) {
+		(*pt)->nr_slots = 1;
+		while ((*pt)->nr_slots < nr_slots)
+			(*pt)->nr_slots <<= 1;
+	}
+	return rv;
+}
+
+static int is_hex(int x)
+{
+	return (x >= '0' && x <= '9') || (x >= 'a' && x <= 'f') ||
+	       (x >= 'A' && x <= 'F');
+}
+
+static int uuid_seg(const char *p, long len)
+{
+	long i;
+
+	if (len != 36)
+		return 0;
+	for (i = 0; i < 36; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (p[i] != '-')
+				return 0;
+		} else if (!is_hex((unsigned char)p[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* returns the placeholder for a segment, or NULL to keep it */
+static const char *
+path_seg_placeholder(struct path_tpl *pt, const char *p, long len, long *n)
+{
+	long i, digits = 0;
+	long nr = RARRAY_LEN(pt->patterns);
+
+	if (nr) {
+		VALUE seg = rb_str_new(p, len);
+
+		for (i = 0; i < nr; i++) {
+			VALUE pair = rb_ary_entry(pt->patterns, i);
+
+			if (RTEST(rb_funcall(rb_ary_entry(pair, 0), match_p_id,
+			                     1, seg))) {
+				pair = rb_ary_entry(pair, 1);
+				*n = RSTRING_LEN(pair);
+				return RSTRING_PTR(pair);
+			}
+		}
+	}
+	if (uuid_seg(p, len)) {
+		*n = sizeof(":uuid") - 1;
+		return ":uuid";
+	}
+	for (i = 0; i < len; i++) {
+		unsigned char x = p[i];
+
+		if (x >= '0' && x <= '9')
+			digits++;
+		else if (!is_hex(x))
+			return NULL;
+	}
+	if (digits == len) {
+		*n = sizeof(":id") - 1;
+		return ":id";
+	}
+	if (len >= 8 && digits) {
+		*n = sizeof(":hex") - 1;
+		return ":hex";
+	}
+	return NULL;
+}
+
+/* the most path_tpl_build() may write for +len+ bytes of path */
+static long path_tpl_max(const struct path_tpl *pt, const char *p, long len)
+{
+	const char *end = p + len;
+	long segs = 1;
+
+	while ((p = memchr(p, '/', end - p))) {
+		segs++;
+		p++;
+	}
+	return len + segs * pt->ph_max;
+}
+
+/* writes the template of +p+ to +out+, returns its length */
+static long
+path_tpl_build(struct path_tpl *pt, const char *p, long len, char *out)
+{
+	const char *end = p + len;
+	char *o = out;
+
+	for (;;) {
+		const char *slash = memchr(p, '/', end - p);
+		long seg_len = (slash ? slash : end) - p;
+		const char *ph = NULL;
+		long n = 0;
+
+		if (seg_len)
+			ph = path_seg_placeholder(pt, p, seg_len, &n);
+		if (ph) {
+			memcpy(o, ph, n);
+			o += n;
+		} else {
+			memcpy(o, p, seg_len);
+			o += seg_len;
+		}
+		if (!slash)
+			break;
+		*o++ = '/';
+		p = slash + 1;
+	}
+	return o - out;
+}
+
+/*
+ * returns the memo slot for +p+, NULL without a memo or if +p+ is too
+ * long to be worth keeping a copy of
+ */
+static struct path_tpl_slot *
+path_tpl_slot(struct path_tpl *pt, const char *p, long len, uint64_t *hash)
+{
+	if (!pt->nr_slots || len > PATH_TEMPLATE_MEMO_MAX)
+		return NULL;
+	if (!pt->slots)
+		pt->slots = ZALLOC_N(struct path_tpl_slot, pt->nr_slots);
+	*hash = dedup_hash(0x9e3779b97f4a7c15ULL, p, len);
+	return &pt->slots[*hash & (pt->nr_slots - 1)];
+}
+
+static int path_tpl_hit(const struct path_tpl_slot *s, uint64_t hash,
+                        const char *p, long len)
+{
+	return s->path && s->hash == hash && s->path_len == len &&
+	       !memcmp(s->path, p, len);
+}
+
+static void path_tpl_store(struct path_tpl_slot *s, uint64_t hash,
+                           const char *p, long len,
+                           const char *tpl, long tpl_len)
+{
+	REALLOC_N(s->path, char, len ? len : 1);
+	memcpy(s->path, p, len);
+	REALLOC_N(s->tpl, char, tpl_len ? tpl_len : 1);
+	memcpy(s->tpl, tpl, tpl_len);
+	s->hash = hash;
+	s->path_len = len;
+	s->tpl_len = tpl_len;
+}
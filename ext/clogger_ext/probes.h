@@ -0,0 +1,24 @@
+/*
+ * optional USDT (sys/sdt.h) static probes for bpftrace/perf/SystemTap,
+ * these compile to a single NOP each when enabled and to nothing at all
+ * when sys/sdt.h is missing at build time:
+ *
+ *   clogger:request__start
+ *   clogger:app__return(status)
+ *   clogger:body__first(bytes)
+ *   clogger:format__start
+ *   clogger:format__done(status, line_length)
+ *   clogger:write__done(status, bytes, line_length)
+ */
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define CLOGGER_PROBE(name) DTRACE_PROBE(clogger, name)
+#  define CLOGGER_PROBE1(name,a) DTRACE_PROBE1(clogger, name, a)
+#  define CLOGGER_PROBE2(name,a,b) DTRACE_PROBE2(clogger, name, a, b)
+#  define CLOGGER_PROBE3(name,a,b,c) DTRACE_PROBE3(clogger, name, a, b, c)
+#else
+#  define CLOGGER_PROBE(name) do {} while (0)
+#  define CLOGGER_PROBE1(name,a) do {} while (0)
+#  define CLOGGER_PROBE2(name,a,b) do {} while (0)
+#  define CLOGGER_PROBE3(name,a,b,c) do {} while (0)
+#endif
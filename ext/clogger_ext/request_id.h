@@ -0,0 +1,86 @@
+/*
+ * $request_id: a well-formed incoming X-Request-Id, or a new ID made of
+ * a random per-process prefix and a counter, as 32 hex digits.  Both
+ * only change with the GVL held, so a plain counter is as unique as a
+ * per-thread one.  The prefix is redrawn in forked children, before
+ * their first ID.
+ */
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#define REQUEST_ID_LEN 32 /* of the ones we make */
+#define REQUEST_ID_MAX 128 /* incoming ones may be longer */
+
+static uint64_t rid_prefix;
+static uint64_t rid_seq;
+#ifdef HAVE_PTHREAD_H
+static volatile int rid_stale = 1;
+
+static void rid_atfork_child(void)
+{
+	rid_stale = 1;
+}
+#  define RID_STALE() (rid_stale)
+#else /* no pthread_atfork, we'll pay for getpid() */
+static pid_t rid_pid;
+#  define RID_STALE() (rid_pid != getpid())
+#endif
+
+/* Ruby reseeds its PRNG after fork, so this never repeats a parent's */
+static void rid_seed(void)
+{
+	rid_prefix = (uint64_t)rb_genrand_int32() << 32 | rb_genrand_int32();
+	rid_seq = rb_genrand_int32();
+#ifdef HAVE_PTHREAD_H
+	rid_stale = 0;
+#else
+	rid_pid = getpid();
+#endif
+}
+
+static void put_hex64(char *p, uint64_t v)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 15; i >= 0; i--, v >>= 4)
+		p[i] = hex[v & 0xf];
+}
+
+/* fills +buf+ with REQUEST_ID_LEN bytes */
+static void request_id_new(char *buf)
+{
+	if (RID_STALE())
+		rid_seed();
+	put_hex64(buf, rid_prefix);
+	put_hex64(buf + 16, rid_seq++);
+}
+
+/* IDs from upstream are logged unescaped, so they must be boring */
+static int request_id_valid(const char *p, long len)
+{
+	long i;
+
+	if (len <= 0 || len > REQUEST_ID_MAX)
+		return 0;
+	for (i = 0; i < len; i++) {
+		unsigned char x = p[i];
+
+		if ((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') ||
+		    (x >= '0' && x <= '9'))
+			continue;
+		if (!memchr("-_.:+/=@", x, 8))
+			return 0;
+	}
+	return 1;
+}
+
+static void init_request_id(void)
+{
+#ifdef HAVE_PTHREAD_H
+	(void)pthread_atfork(NULL, NULL, rid_atfork_child);
+#endif
+}
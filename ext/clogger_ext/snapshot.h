@@ -0,0 +1,99 @@
+/*
+ * :snapshot capture buffer.  With the GVL held, rendering only copies
+ * the raw bytes of each variable (or, for time variables, the time)
+ * into here; escaping, caps, time formatting and write(2) happen once
+ * the GVL is released.  Raw bytes are copied rather than pointed to
+ * since nothing keeps other threads (or GC compaction) away from the
+ * Strings they came from.  Each reentrant copy gets its own, like
+ * log_buf.
+ */
+#include <string.h>
+#include <stdlib.h>
+
+enum snap_kind {
+	SNAP_OP, /* starts a variable: arg=finish_line first, n=cap */
+	SNAP_RAW, /* bytes to copy as-is */
+	SNAP_XS, /* bytes to escape */
+	SNAP_TIME, /* arg=special time variable, t */
+	SNAP_STRFTIME /* arg=opcode, n=buffer size, t, payload=format */
+};
+
+struct snap_seg {
+	int kind;
+	int arg;
+	long n;
+	time_t t;
+	long len; /* of the payload following this header */
+};
+
+struct snapshot {
+	char *ptr; /* snap_segs and their payloads, GVL only */
+	size_t len;
+	size_t capa;
+	char *out; /* rendered line, malloc-ed since we grow it without GVL */
+	size_t out_len;
+	size_t out_capa;
+	int enomem;
+	int utf8; /* :escape => :utf8 */
+};
+
+static void snapshot_free(void *ptr)
+{
+	struct snapshot *sn = ptr;
+
+	xfree(sn->ptr);
+	free(sn->out);
+	xfree(sn);
+}
+
+static VALUE snapshot_new(struct snapshot **sn)
+{
+	return Data_Make_Struct(0, struct snapshot, NULL, snapshot_free, *sn);
+}
+
+static void snap_put(struct snapshot *sn, int kind, int arg, long n, time_t t,
+                     const char *ptr, long len)
+{
+	struct snap_seg seg;
+	size_t need = sn->len + sizeof(seg) + len;
+
+	if (need > sn->capa) {
+		size_t capa = sn->capa ? sn->capa : 256;
+
+		while (capa < need)
+			capa *= 2;
+		REALLOC_N(sn->ptr, char, capa);
+		sn->capa = capa;
+	}
+	seg.kind = kind;
+	seg.arg = arg;
+	seg.n = n;
+	seg.t = t;
+	seg.len = len;
+	memcpy(sn->ptr + sn->len, &seg, sizeof(seg));
+	if (len)
+		memcpy(sn->ptr + sn->len + sizeof(seg), ptr, len);
+	sn->len = need;
+}
+
+/* may run without the GVL, sets +enomem+ instead of raising */
+static int snap_out_reserve(struct snapshot *sn, size_t len)
+{
+	size_t need = sn->out_len + len;
+
+	if (need > sn->out_capa) {
+		size_t capa = sn->out_capa ? sn->out_capa : 256;
+		char *out;
+
+		while (capa < need)
+			capa *= 2;
+		out = realloc(sn->out, capa);
+		if (!out) {
+			sn->enomem = 1;
+			return 0;
+		}
+		sn->out = out;
+		sn->out_capa = capa;
+	}
+	return 1;
+}
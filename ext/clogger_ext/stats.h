@@ -0,0 +1,126 @@
+/*
+ * counters for Clogger#stats and Clogger.stats.  Each Clogger (and all
+ * of its reentrant copies) shares one clogger_stats, and every update
+ * is mirrored into a process-wide aggregate.  Updates are relaxed
+ * atomics so they add no contention if we're ever called without
+ * the GVL.
+ */
+#include <stdint.h>
+
+struct clogger_stats {
+	uint64_t lines;
+	uint64_t bytes;
+	uint64_t write_calls; /* write(2) syscalls */
+	uint64_t short_writes;
+	uint64_t write_retries; /* EINTR/EAGAIN */
+	uint64_t logger_lines; /* written via logger#<< or rack.errors */
+	uint64_t format_time_ns;
+	uint64_t format_time_max_ns;
+	uint64_t write_time_ns;
+	uint64_t write_time_max_ns;
+	uint64_t log_buf_max; /* log_buf high-water mark */
+	uint64_t suppressed; /* by :dedup */
+};
+
+static struct clogger_stats g_stats;
+
+#if defined(__GNUC__) && defined(__ATOMIC_RELAXED)
+static inline void stat_add1(uint64_t *p, uint64_t n)
+{
+	__atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+static inline void stat_max1(uint64_t *p, uint64_t n)
+{
+	uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (n > cur && !__atomic_compare_exchange_n(p, &cur, n, 1,
+	                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline uint64_t stat_get(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+#else /* we always hold the GVL, anyways */
+static inline void stat_add1(uint64_t *p, uint64_t n)
+{
+	*p += n;
+}
+
+static inline void stat_max1(uint64_t *p, uint64_t n)
+{
+	if (n > *p)
+		*p = n;
+}
+
+static inline uint64_t stat_get(const uint64_t *p)
+{
+	return *p;
+}
+#endif
+
+#define STAT_ADD(st,field,n) do { \
+	stat_add1(&(st)->field, (n)); \
+	stat_add1(&g_stats.field, (n)); \
+} while (0)
+
+#define STAT_MAX(st,field,n) do { \
+	stat_max1(&(st)->field, (n)); \
+	stat_max1(&g_stats.field, (n)); \
+} while (0)
+
+/* adds the duration since +start+ and returns the current time */
+#define STAT_TIME(st,field,start,now) do { \
+	uint64_t ns_; \
+	clock_gettime(hopefully_CLOCK_MONOTONIC, (now)); \
+	ns_ = (uint64_t)((now)->tv_sec - (start)->tv_sec) * 1000000000 + \
+	      (now)->tv_nsec - (start)->tv_nsec; \
+	STAT_ADD(st, field##_ns, ns_); \
+	STAT_MAX(st, field##_max_ns, ns_); \
+} while (0)
+
+static void clogger_stats_free(void *ptr)
+{
+	xfree(ptr);
+}
+
+static VALUE clogger_stats_new(struct clogger_stats **st)
+{
+	return Data_Make_Struct(0, struct clogger_stats,
+	                        NULL, clogger_stats_free, *st);
+}
+
+static VALUE ns2sec(uint64_t ns)
+{
+	return rb_float_new((double)ns / 1e9);
+}
+
+#define STAT_ASET(h,st,field) \
+	rb_hash_aset((h), ID2SYM(rb_intern(#field)), \
+	             ULL2NUM(stat_get(&(st)->field)))
+
+#define STAT_ASET_SEC(h,st,field) \
+	rb_hash_aset((h), ID2SYM(rb_intern(#field)), \
+	             ns2sec(stat_get(&(st)->field##_ns)))
+
+static VALUE stats_hash(struct clogger_stats *st)
+{
+	VALUE h = rb_hash_new();
+
+	STAT_ASET(h, st, lines);
+	STAT_ASET(h, st, bytes);
+	STAT_ASET(h, st, write_calls);
+	STAT_ASET(h, st, short_writes);
+	STAT_ASET(h, st, write_retries);
+	STAT_ASET(h, st, logger_lines);
+	STAT_ASET_SEC(h, st, format_time);
+	STAT_ASET_SEC(h, st, format_time_max);
+	STAT_ASET_SEC(h, st, write_time);
+	STAT_ASET_SEC(h, st, write_time_max);
+	STAT_ASET(h, st, log_buf_max);
+	STAT_ASET(h, st, suppressed);
+
+	return h;
+}
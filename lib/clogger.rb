@@ -15,10 +15,15 @@ class Clogger
   OP_REQUEST_TIME = 7
   OP_TIME = 8
   OP_COOKIE = 9
+  OP_ARG = 10
+  OP_CPU_TIME = 11
+  OP_GC_TIME = 12
 
   # support nginx variables that are less customizable than our own
   ALIASES = {
     '$request_time' => '$request_time{3}',
+    '$cpu_time' => '$cpu_time{3}',
+    '$gc_time' => '$gc_time{3}',
     '$msec' => '$time{3}',
     '$usec' => '$time{6}',
     '$http_content_length' => '$content_length',
@@ -29,7 +34,7 @@ class Clogger
     :body_bytes_sent => 0,
     :status => 1,
     :request => 2, # REQUEST_METHOD PATH_INFO?QUERY_STRING HTTP_VERSION
-    :request_length => 3, # env['rack.input'].size
+    :request_length => 3, # CONTENT_LENGTH || bytes read from rack.input
     :response_length => 4, # like body_bytes_sent, except "-" instead of "0"
     :ip => 5, # HTTP_X_FORWARDED_FOR || REMOTE_ADDR || -
     :pid => 6, # getpid()
@@ -37,8 +42,135 @@ class Clogger
     :time_iso8601 => 8,
     :time_local => 9,
     :time_utc => 10,
+    :real_ip => 11, # first untrusted HTTP_X_FORWARDED_FOR || REMOTE_ADDR || -
+    :gc_count => 12, # GC runs during the request (process-wide)
+    :allocated_objects => 13, # objects allocated during the request
+    :repeat_count => 14, # lines a :dedup summary stands for, otherwise 1
+    :request_id => 15, # valid HTTP_X_REQUEST_ID, or prefix + counter
+    :path_template => 16, # PATH_INFO with IDs replaced, e.g. /users/:id
   }
 
+  # :buffer-ed Cloggers, and lines logged from fibers under a
+  # Fiber.scheduler, are flushed (and :dedup summaries written) by a
+  # background thread so idle servers don't hold onto lines, and again
+  # at exit.  :rotate_size and
+  # :rotate_interval renames and reopens happen in another background
+  # thread, never in the request path.  Both threads are started lazily,
+  # so forked workers get their own.
+  @buffered = ObjectSpace::WeakMap.new
+  @reopenable = ObjectSpace::WeakMap.new
+  @flush_interval = nil
+  @rotate_queue = Queue.new
+  @bg_pids = {}
+  @flusher = nil
+  @bg_lock = Mutex.new
+
+  def self.register_buffer(clogger, interval)
+    @bg_lock.synchronize do
+      at_exit { flush_all(true) } if @flush_interval.nil?
+      @buffered[clogger] = true
+      if @flush_interval.nil? || interval < @flush_interval
+        @flush_interval = interval
+      end
+    end
+  end
+
+  def self.register_path(clogger)
+    @bg_lock.synchronize { @reopenable[clogger] = true }
+  end
+
+  # runs the block in a new thread, once per process
+  def self.background(name, &block)
+    return if @bg_pids[name] == $$
+    @bg_lock.synchronize do
+      return if @bg_pids[name] == $$
+      @bg_pids[name] = $$
+      Thread.new(&block)
+    end
+  end
+
+  def self.start_flusher
+    thr = background(:flusher) do
+      loop { sleep(@flush_interval); flush_all(false) }
+    end
+    @flusher = thr if thr
+  end
+
+  # wakes the flusher up early once lines logged from fibers pile up
+  def self.flush_soon
+    @bg_pids[:flusher] == $$ and @flusher.wakeup
+  rescue ThreadError # it died
+  end
+
+  def self.flush_all(force)
+    @buffered.each_key do |clogger|
+      begin
+        clogger.flush(force)
+      rescue => e
+        warn "clogger: flush failed: #{e.message} (#{e.class})"
+      end
+    end
+  end
+
+  def self.rotate_later(clogger)
+    background(:rotator) do
+      while clogger = @rotate_queue.pop
+        begin
+          clogger.rotate
+        rescue => e
+          warn "clogger: rotate failed: #{e.message} (#{e.class})"
+        end
+      end
+    end
+    @rotate_queue << clogger
+  end
+
+  # :startdoc:
+
+  # Reopens the :path of every Clogger in this process, for use with
+  # logrotate(8) or similar tools, e.g. in a USR1 signal handler:
+  #
+  #   trap(:USR1) { Clogger.reopen_all }
+  #
+  # Requests being logged while this runs are neither blocked nor lost.
+  def self.reopen_all
+    # :outputs register their own :path, don't reopen them twice
+    @reopenable.each_key { |clogger| clogger.__send__(:reopen_path) }
+  end
+
+  # Renames the :path file with a timestamp suffix and reopens :path.
+  # This happens automatically with :rotate_size or :rotate_interval.
+  # Processes sharing :path take turns under flock(2), and only rename
+  # it if it's still the file they're writing to; the others just
+  # follow it to the new file.  A failed rotation is retried a minute
+  # later.
+  def rotate
+    path = log_path or return
+    begin
+      File.open(path, 'rb') do |fp|
+        fp.flock(File::LOCK_EX)
+        mine = IO.for_fd(fileno, :autoclose => false).stat
+        cur = File.stat(path)
+        if cur.ino == mine.ino && cur.dev == mine.dev
+          dst = "#{path}.#{Time.now.strftime('%Y%m%d-%H%M%S')}"
+          n = 0
+          n += 1 while File.exist?(n == 0 ? dst : "#{dst}.#{n}")
+          dst = "#{dst}.#{n}" if n != 0
+          File.rename(path, dst)
+          idx = "#{path}.idx"
+          File.rename(idx, "#{dst}.idx") if File.exist?(idx)
+        end
+      end
+    rescue Errno::ENOENT # renamed by another process, not reopened yet
+    end
+    reopen_path
+  rescue
+    rotate_failed
+    raise
+  end
+
+  # :stopdoc:
+
 private
 
   CGI_ENV = Regexp.new('\A\$(' <<
@@ -51,10 +183,18 @@ private
 
   SCAN = /([^$]*)(\$+(?:env\{\w+(?:\.[\w\.]+)?\}|
                         e\{[^\}]+\}|
-                        (?:request_)?time\{\d+\}|
+                        (?:request_|cpu_|gc_)?time\{\d+\}|
                         time_(?:utc|local)\{[^\}]+\}|
+                        \w+\{\d+\}|
                         \w*))?([^$]*)/x
 
+  CAPPABLE_OPS = [ OP_REQUEST, OP_RESPONSE, OP_SPECIAL, OP_COOKIE, OP_ARG ]
+
+  # these take their own argument in braces, everything else takes a
+  # length cap, e.g. $http_user_agent{256}
+  BRACE_VARS = %w($e $env $time $request_time $time_local $time_utc
+                  $cpu_time $gc_time)
+
   def compile_format(str, opt = {})
     str = Clogger::Format.const_get(str) if Symbol === str
     longest_day = Time.at(26265600) # "Saturday, November 01, 1970 00:00:00"
@@ -70,6 +210,13 @@ private
 
         compat = ALIASES[tok] and tok = compat
 
+        # $http_user_agent{256} => truncate to 256 bytes (after escaping)
+        max = nil
+        if /\A(\$\w+)\{(\d+)\}\z/ =~ tok && !BRACE_VARS.include?($1)
+          tok, max = $1, $2.to_i
+          compat = ALIASES[tok] and tok = compat
+        end
+
         case tok
         when /\A(\$*)\z/
           rv << [ OP_LITERAL, $1 ]
@@ -79,6 +226,8 @@ private
           rv << [ OP_EVAL, $1 ]
         when /\A\$cookie_(\w+)\z/
           rv << [ OP_COOKIE, $1 ]
+        when /\A\$arg_(\w+)\z/
+          rv << [ OP_ARG, $1 ]
         when CGI_ENV, /\A\$(http_\w+)\z/
           rv << [ OP_REQUEST, $1.upcase ]
         when /\A\$sent_http_(\w+)\z/
@@ -93,6 +242,10 @@ private
           rv << [ OP_TIME, *usec_conv_pair(tok, $1.to_i) ]
         when /\A\$request_time\{(\d+)\}\z/
           rv << [ OP_REQUEST_TIME, *usec_conv_pair(tok, $1.to_i) ]
+        when /\A\$cpu_time\{(\d+)\}\z/
+          rv << [ OP_CPU_TIME, *usec_conv_pair(tok, $1.to_i) ]
+        when /\A\$gc_time\{(\d+)\}\z/
+          rv << [ OP_GC_TIME, *usec_conv_pair(tok, $1.to_i) ]
         else
           tok_sym = tok[1..-1].to_sym
           if special_code = SPECIAL_VARS[tok_sym]
@@ -101,6 +254,12 @@ private
             raise ArgumentError, "unable to make sense of token: #{tok}"
           end
         end
+
+        if max
+          CAPPABLE_OPS.include?(rv.last[0]) or
+            raise ArgumentError, "#{tok} may not be truncated"
+          rv.last << max
+        end
       end
 
       rv << [ OP_LITERAL, post ] if post && post != ""
@@ -127,11 +286,138 @@ private
     end
   end
 
+  # each output is an app-less Clogger, we only use its format, sink,
+  # :if and :max_line_length.  Everything else is per-request state
+  # which belongs to the parent.
+  def compile_outputs(opts)
+    %w(format logger path).each do |key|
+      opts.include?(key.to_sym) and
+        raise ArgumentError, ":#{key} and :outputs are independent"
+    end
+    outputs = opts[:outputs]
+    Array === outputs && ! outputs.empty? or
+      raise ArgumentError, ":outputs must be a non-empty Array"
+    outputs.map do |o|
+      Hash === o or raise ArgumentError, ":outputs must contain Hashes"
+      o.include?(:outputs) and raise ArgumentError, ":outputs may not nest"
+      self.class.new(nil, o)
+    end
+  end
+
+  DEDUP_WINDOW = 60.0
+
+  # returns [ [ PATH_INFO prefix, window seconds ], ... ] for :dedup,
+  # which takes a { prefix => seconds } Hash or an Array of prefixes
+  def compile_dedup(dedup)
+    dedup = { '/' => DEDUP_WINDOW } if true == dedup
+    dedup = Array(dedup).map { |prefix, window|
+      prefix = prefix.to_s.dup.force_encoding(Encoding::BINARY).freeze
+      window = window ? Float(window) : DEDUP_WINDOW
+      window > 0 or raise ArgumentError, ":dedup windows must be positive"
+      [ prefix, window ]
+    }
+    dedup.empty? and raise ArgumentError, ":dedup needs a path prefix"
+    dedup
+  end
+
+  # true for :escape => :utf8, false for the default of escaping every
+  # byte >= 0x7f (:bytes)
+  def compile_escape(escape)
+    case escape
+    when nil, :bytes then false
+    when :utf8 then true
+    else
+      raise ArgumentError, ":escape must be :bytes or :utf8"
+    end
+  end
+
+  # returns [ io, entries ] for :flight_recorder, which takes
+  # { :path => "/dev/shm/...", :entries => 4096 }
+  def compile_flight_recorder(fr)
+    Hash === fr or raise ArgumentError, ":flight_recorder must be a Hash"
+    path = fr[:path] or raise ArgumentError, ":flight_recorder needs a :path"
+    entries = Integer(fr[:entries] || FlightRecorder::ENTRIES)
+    entries > 0 or raise ArgumentError, ":flight_recorder entries must be positive"
+    [ FlightRecorder.open_writer(path, entries), entries ]
+  end
+
+  # [ [ Regexp, placeholder ], ... ] for :path_patterns, tried in order
+  # on each PATH_INFO segment before the built-in rules
+  def compile_path_patterns(patterns)
+    Array(patterns).map do |re, ph|
+      Regexp === re or raise ArgumentError, ":path_patterns need Regexps"
+      ph = ph.to_s.b.freeze
+      ph.empty? || ph.include?('/') and
+        raise ArgumentError, "bad :path_patterns placeholder: #{ph.inspect}"
+      [ re, ph ]
+    end.freeze
+  end
+
+  # how often the background thread checks for windows which ended
+  def dedup_interval(dedup)
+    [ 1.0, *dedup.map(&:last) ].min
+  end
+
+  # the most digits any $request_time{N} or $time{N} shows
+  def time_precision(fmt_ops)
+    fmt_ops.map do |op|
+      OP_REQUEST_TIME == op[0] || OP_TIME == op[0] ? op[1][/%0(\d)d/, 1].to_i : 0
+    end.max || 0
+  end
+
+  # the worst resolution of the _COARSE clocks in nanoseconds, nil if we
+  # don't have them
+  def coarse_resolution
+    defined?(Process::CLOCK_MONOTONIC_COARSE) &&
+      defined?(Process::CLOCK_REALTIME_COARSE) or return
+    [ Process::CLOCK_MONOTONIC_COARSE, Process::CLOCK_REALTIME_COARSE ].map do
+      |clk| Process.clock_getres(clk, :nanosecond)
+    end.max
+  rescue Errno::EINVAL
+  end
+
+  # returns :coarse if the cheaper _COARSE clocks can keep up with the
+  # precision the format logs, :precise otherwise
+  def compile_clock(clock, fmt_ops)
+    case clock
+    when nil, :precise then return :precise
+    when :auto, :coarse
+    else
+      raise ArgumentError, ":clock must be :precise, :coarse or :auto"
+    end
+    res = coarse_resolution
+    prec = time_precision(fmt_ops)
+    return :coarse if res && res <= 10 ** (9 - prec)
+    clock == :coarse or return :precise
+    raise ArgumentError, res ?
+          "coarse clocks (#{res}ns) are too coarse for #{prec} digits" :
+          "coarse clocks are not supported here"
+  end
+
   def need_response_headers?(fmt_ops)
     fmt_ops.any? { |op| OP_RESPONSE == op[0] }
   end
 
+  def need_input_counter?(fmt_ops)
+    fmt_ops.any? do |op|
+      OP_SPECIAL == op[0] && SPECIAL_VARS[:request_length] == op[1]
+    end
+  end
+
+  def need_cpu_time?(fmt_ops)
+    fmt_ops.any? { |op| OP_CPU_TIME == op[0] }
+  end
+
+  def need_gc_stat?(fmt_ops)
+    fmt_ops.any? do |op|
+      OP_GC_TIME == op[0] || (OP_SPECIAL == op[0] &&
+        (SPECIAL_VARS[:gc_count] == op[1] ||
+         SPECIAL_VARS[:allocated_objects] == op[1]))
+    end
+  end
+
   def need_wrap_body?(fmt_ops)
+    need_cpu_time?(fmt_ops) || need_gc_stat?(fmt_ops) ||
     fmt_ops.any? do |op|
       (OP_REQUEST_TIME == op[0]) || (OP_SPECIAL == op[0] &&
         (SPECIAL_VARS[:body_bytes_sent] == op[1] ||
@@ -147,6 +433,10 @@ private
 end
 
 require 'clogger/format'
+require 'clogger/input_counter'
+require 'clogger/parser'
+require 'clogger/index'
+require 'clogger/flight_recorder'
 
 begin
   raise LoadError if ENV['CLOGGER_PURE'].to_i != 0
@@ -0,0 +1,113 @@
+# -*- encoding: binary -*-
+
+# Reads the ring of recent requests written with
+# <tt>:flight_recorder => { :path => path, :entries => n }</tt>.  The file
+# (best kept on tmpfs, e.g. under /dev/shm) holds a header and +n+
+# fixed-size slots.  Each request gets the next sequence number and
+# the slot it maps to, so the ring always holds the latest +n+ requests
+# of every process sharing the file:
+#
+#   fr = Clogger::FlightRecorder.new("/dev/shm/app.clogger")
+#   fr.each { |r| p [ r.seq, r.status, r.request_time, r.line ] }
+#   fr.each(last_seq + 1) { |r| ... } # only the newer ones
+#
+# Writers never wait for readers.  A slot's sequence word is odd while
+# it's being written and is checked again after the slot is read, so
+# records which were torn or overwritten meanwhile are skipped rather
+# than returned half-written.  Integers are in native byte order, so
+# the file is only meant to be read on the machine writing it.
+class Clogger::FlightRecorder
+
+  # :stopdoc:
+  MAGIC = "CLOGFR1\0"
+  HEADER = 'a8L2Q2' # magic, header size, slot size, entries, head
+  HEADER_SIZE = 64
+  HEAD_OFF = 24 # requests recorded so far, the next sequence number
+  SLOT = 'QqQLSS' # seq * 2 + 2 (odd while writing), time, request time,
+                  # pid, status, line length
+  SLOT_SIZE = 512
+  LINE_OFF = 32
+  LINE_MAX = SLOT_SIZE - LINE_OFF
+  ENTRIES = 4096
+  # :startdoc:
+
+  # :seq counts from zero across all writers, :time is the Float
+  # seconds since the Epoch the request was logged at, :request_time
+  # Float seconds, :line the log line (without its newline, cut at
+  # 480 bytes).  :status is zero if the app returned a non-Integer.
+  Record = Struct.new(:seq, :time, :request_time, :pid, :status, :line)
+
+  # opens (creating it if needed) the file at +path+ for writing and
+  # returns it.  An existing file is reused if it has +entries+ slots,
+  # otherwise a fresh one replaces it, leaving writers with the old
+  # layout to write to the unlinked file rather than crash.
+  def self.open_writer(path, entries)
+    begin
+      io = File.open(path, File::RDWR | File::CREAT, 0644)
+      io.binmode
+      io.flock(File::LOCK_EX)
+      st = File.stat(path) rescue nil
+      st && st.ino == io.stat.ino and break
+      io.close # renamed over while we waited for the lock
+    end while true
+    size = HEADER_SIZE + entries * SLOT_SIZE
+    hdr = io.size >= HEADER_SIZE ? io.pread(HEADER_SIZE, 0).unpack(HEADER) : []
+    if hdr[0, 4] != [ MAGIC, HEADER_SIZE, SLOT_SIZE, entries ] ||
+       io.size != size
+      tmp = "#{path}.#$$.tmp"
+      File.open(tmp, 'wb', 0644) do |fp|
+        fp.truncate(size)
+        fp.pwrite([ MAGIC, HEADER_SIZE, SLOT_SIZE, entries, 0 ].pack(HEADER), 0)
+      end
+      File.rename(tmp, path)
+      io.close
+      return open_writer(path, entries)
+    end
+    io.flock(File::LOCK_UN)
+    io
+  rescue
+    io.close if io && !io.closed?
+    raise
+  end
+
+  # opens the flight recorder file at +path+ read-only
+  def initialize(path)
+    @io = File.open(path, 'rb')
+    magic, hsize, slot_size, @entries = @io.pread(HEADER_SIZE, 0).unpack(HEADER)
+    magic == MAGIC && hsize == HEADER_SIZE && slot_size == SLOT_SIZE or
+      raise ArgumentError, "#{path} is not a Clogger flight recorder"
+  end
+
+  # number of slots
+  attr_reader :entries
+
+  # the number of requests recorded so far, the +seq+ of the next one
+  def head
+    @io.pread(8, HEAD_OFF).unpack1('Q')
+  end
+
+  # yields each intact Record still in the ring with a +seq+ of at
+  # least +since+, oldest first
+  def each(since = 0)
+    block_given? or return enum_for(__method__, since)
+    stop = head
+    seq = stop - @entries
+    seq = since if since > seq
+    while seq < stop
+      off = HEADER_SIZE + (seq % @entries) * SLOT_SIZE
+      buf = @io.pread(SLOT_SIZE, off)
+      tag, t, rt, pid, status, len = buf.unpack(SLOT)
+      if tag == seq * 2 + 2 && @io.pread(8, off).unpack1('Q') == tag
+        yield Record.new(seq, t / 1e9, rt / 1e9, pid, status,
+                         buf.byteslice(LINE_OFF, len))
+      end
+      seq += 1
+    end
+    self
+  end
+  include Enumerable
+
+  def close
+    @io.close
+  end
+end
@@ -0,0 +1,120 @@
+# -*- encoding: binary -*-
+
+# Looks up time ranges in a log written with <tt>:index => true</tt>.
+# The index lives next to the log as "#{path}.idx" and holds one record
+# for the first line written each second: the second, the byte offset
+# of that line and how many lines came before it.  Lookups are binary
+# searches over the index, so only the requested part of the log is read:
+#
+#   idx = Clogger::Index.new("/path/to/log")
+#   idx.byte_range(Time.at(t0), Time.at(t1)) # => 1234567...1299999
+#   idx.each_line(t0, t1) { |line| ... }
+#
+# Lines are indexed by when they were written, which can trail
+# $time_local by however long the request took.
+class Clogger::Index
+
+  # :stopdoc:
+  RECORD = 'q<q<q<' # unix second, byte offset, lines before it
+  RECORD_SIZE = 24
+  # :startdoc:
+
+  # opens the index of the log at +path+ for appending, returns
+  # [ io, lines ] where +lines+ is how many lines +path+ already has
+  def self.open_writer(path)
+    io = File.open("#{path}.idx", 'a+b')
+    io.sync = true
+    size = io.size
+    off = lines = 0
+    if size % RECORD_SIZE != 0 # torn by a crash
+      size -= size % RECORD_SIZE
+      io.truncate(size)
+    end
+    if size > 0
+      _, off, lines = io.pread(RECORD_SIZE, size - RECORD_SIZE).unpack(RECORD)
+      if off > File.size(path) # the log was replaced behind our back
+        io.truncate(0)
+        off = lines = 0
+      end
+    end
+    [ io, lines + count_lines(path, off) ]
+  end
+
+  # counts the lines in +path+ after +off+
+  def self.count_lines(path, off)
+    n = 0
+    File.open(path, 'rb') do |fp|
+      fp.pos = off
+      buf = ''.b
+      n += buf.count("\n") while fp.read(0x100000, buf)
+    end
+    n
+  end
+
+  # +path+ is the log file, not the index
+  def initialize(path)
+    @path = path
+  end
+
+  # returns the Range of byte offsets in the log holding the lines written
+  # from +from+ up to (but not including) +to+, which may be Time objects
+  # or seconds since the Epoch
+  def byte_range(from, to)
+    lookup(from, to) { |first, last| first[1]...last[1] }
+  end
+
+  # like byte_range, but returns the Range of (zero-based) line numbers
+  def line_range(from, to)
+    lookup(from, to) { |first, last| first[2]...last[2] }
+  end
+
+  # yields each line written from +from+ up to (but not including) +to+
+  def each_line(from, to)
+    block_given? or return enum_for(__method__, from, to)
+    range = byte_range(from, to)
+    File.open(@path, 'rb') do |fp|
+      fp.pos = range.begin
+      left = range.size
+      while left > 0 && (line = fp.gets)
+        left -= line.bytesize
+        yield line
+      end
+    end
+    self
+  end
+
+  # number of records, there is at most one per second
+  def size
+    File.size(index_path) / RECORD_SIZE
+  end
+
+private
+
+  def index_path
+    "#{@path}.idx"
+  end
+
+  def lookup(from, to)
+    from = from.to_r.floor
+    to = to.to_r.ceil
+    File.open(index_path, 'rb') do |io|
+      n = io.size / RECORD_SIZE
+      rec = lambda { |i| io.pread(RECORD_SIZE, i * RECORD_SIZE).unpack(RECORD) }
+      bound = lambda do |sec|
+        i = (0...n).bsearch { |j| rec[j][0] >= sec }
+        i ? rec[i] : eof(n > 0 ? rec[n - 1] : nil)
+      end
+      first = bound[from]
+      last = bound[to]
+      last = first if last[1] < first[1] # the clock went backwards
+      yield first, last
+    end
+  end
+
+  # a pseudo-record for the end of the log
+  def eof(last)
+    off, lines = last ? last.values_at(1, 2) : [ 0, 0 ]
+    size = File.size(@path)
+    [ nil, size, lines + self.class.count_lines(@path, off) ]
+  end
+end
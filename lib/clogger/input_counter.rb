@@ -0,0 +1,59 @@
+# -*- encoding: binary -*-
+# :stopdoc:
+
+# thin rack.input wrapper installed when $request_length is logged
+# but the request has no CONTENT_LENGTH (e.g. chunked uploads).  This
+# tallies the bytes the application consumes instead of calling
+# rack.input.size, which forces TeeInput-style inputs to buffer the
+# entire request body to disk just so we can log a number.
+class Clogger::InputCounter
+  def initialize(input)
+    @input = input
+    @pos = @max = 0
+  end
+
+  # bytes consumed by the application, rewinding does not double count
+  def bytes_read
+    @pos > @max ? @pos : @max
+  end
+
+  def gets
+    tally(@input.gets)
+  end
+
+  def read(*args)
+    tally(@input.read(*args))
+  end
+
+  def each
+    while line = gets
+      yield line
+    end
+    self
+  end
+
+  def rewind
+    @max = bytes_read
+    @pos = 0
+    @input.rewind
+  end
+
+  def close
+    @input.close
+  end
+
+  def respond_to_missing?(method, include_all)
+    @input.respond_to?(method, include_all)
+  end
+
+  def method_missing(*args, &block)
+    @input.__send__(*args, &block)
+  end
+
+private
+
+  def tally(buf)
+    @pos += buf.bytesize if buf
+    buf
+  end
+end
@@ -0,0 +1,91 @@
+# -*- encoding: binary -*-
+require 'etc'
+
+# Reads logs written by Clogger back in, using the same format
+# definitions they were written with:
+#
+#   parser = Clogger::Parser.new(:Combined)
+#   parser.each("/path/to/log") { |fields| p fields }
+#   parser.tally("/path/to/log", "$status") # => { "200" => 1234, ... }
+#
+# Fields are returned exactly as they were logged, use
+# Clogger::Parser.unescape to decode "\xHH" escapes where needed.
+# Every variable must be followed by some literal text which can't
+# appear in it (e.g. a quote after a quoted, escaped variable), so
+# lines can be split without backtracking.
+class Clogger::Parser
+
+  # names of the variables in each line, e.g. [ "$remote_addr", ... ]
+  attr_reader :fields
+
+  # +format+ is anything Clogger accepts for :format, e.g. :Combined
+  def initialize(format = Clogger::Format::Common)
+    @literals, @fields = compile_layout(format)
+  end
+
+  # Counts the distinct values of +field+ (a variable name like
+  # "$status", or its index in #fields) in the log at +path+, splitting
+  # the file across +threads+ threads.  Values are still escaped.
+  def tally(path, field, threads = Etc.nprocessors)
+    tally_index(path, field_index(field), threads)
+  end
+
+  # :stopdoc:
+  SPECIAL_NAMES = Clogger::SPECIAL_VARS.invert
+  TIME_NAMES = {
+    Clogger::OP_TIME_LOCAL => '$time_local',
+    Clogger::OP_TIME_UTC => '$time_utc',
+    Clogger::OP_REQUEST_TIME => '$request_time',
+    Clogger::OP_TIME => '$time',
+    Clogger::OP_CPU_TIME => '$cpu_time',
+    Clogger::OP_GC_TIME => '$gc_time',
+  }
+
+  def field_name(op)
+    case op[0]
+    when Clogger::OP_REQUEST
+      /\A[A-Z0-9_]+\z/ =~ op[1] ? "$#{op[1].downcase}" : "$env{#{op[1]}}"
+    when Clogger::OP_RESPONSE then "$sent_http_#{op[1].tr('-', '_')}"
+    when Clogger::OP_SPECIAL then "$#{SPECIAL_NAMES[op[1]]}"
+    when Clogger::OP_EVAL then "$e{#{op[1]}}"
+    when Clogger::OP_COOKIE then "$cookie_#{op[1]}"
+    when Clogger::OP_ARG then "$arg_#{op[1]}"
+    else
+      TIME_NAMES[op[0]]
+    end
+  end
+
+  # returns [ literals, names ]: literals[0] precedes the first variable
+  # and literals[i + 1] follows variable i.  The ORS is dropped since
+  # lines are split on it anyways.
+  def compile_layout(format)
+    ops = Clogger.allocate.__send__(:compile_format, format)
+    literals = [ '' ]
+    names = []
+    ops.each do |op|
+      if Clogger::OP_LITERAL == op[0]
+        literals[-1] += op[1]
+      else
+        names.empty? || literals[-1] != '' or
+          raise ArgumentError, "#{names[-1]} and #{field_name(op)} " \
+                               "need something between them"
+        names << field_name(op)
+        literals << ''
+      end
+    end
+    literals[-1] = literals[-1].delete_suffix("\n")
+    literals[0...-1].each do |lit|
+      lit.include?("\n") and
+        raise ArgumentError, "multi-line formats can't be parsed"
+    end
+    [ literals.map(&:freeze).freeze, names.freeze ]
+  end
+
+  def field_index(field)
+    Integer === field and return field
+    @fields.index(field.to_s) or
+      raise ArgumentError, "#{field} is not in the format"
+  end
+  private :field_name, :compile_layout, :field_index
+  # :startdoc:
+end
@@ -1,37 +1,513 @@
 # -*- encoding: binary -*-
 # :stopdoc:
+require 'ipaddr'
+require 'fiber' # Fiber.current on Ruby < 3.1
 
 # Not at all optimized for performance, this was written based on
 # the original C extension code so it's not very Ruby-ish...
 class Clogger
 
   attr_accessor :env, :status, :headers, :body
-  attr_writer :body_bytes_sent, :start
+  attr_writer :body_bytes_sent, :start, :input, :usage
 
   def initialize(app, opts = {})
     # trigger autoload to avoid thread-safety issues later on
     Rack::Utils::HeaderHash
 
     @app = app
+    @cond = opts[:if]
+    @cond.nil? || @cond.respond_to?(:call) or
+      raise ArgumentError, ":if must respond to call"
+    @outputs = opts[:outputs] && compile_outputs(opts)
+    # we can't release the GVL, so :snapshot is only validated here
+    opts[:snapshot] && (@outputs || opts[:dedup]) and
+      raise ArgumentError, ":snapshot doesn't work with :outputs or :dedup"
     @logger = opts[:logger]
     path = opts[:path]
     path && @logger and
       raise ArgumentError, ":logger and :path are independent"
     path and @logger = File.open(path, "ab")
-
     @logger.sync = true if @logger.respond_to?(:sync=)
-    @fmt_ops = compile_format(opts[:format] || Format::Common, opts)
+    @log_file = path ? LogFile.new(self, path, @logger) : nil
+    @log_file and Clogger.register_path(self)
+
+    @fmt_ops = if @outputs
+      # only used to figure out what each request needs
+      @outputs.inject([]) { |ops, o| ops.concat(o.fmt_ops) }
+    else
+      compile_format(opts[:format] || Format::Common, opts)
+    end
     @wrap_body = need_wrap_body?(@fmt_ops)
     @reentrant = opts[:reentrant]
     @need_resp = need_response_headers?(@fmt_ops)
+    @need_input = need_input_counter?(@fmt_ops)
+    @need_cpu = need_cpu_time?(@fmt_ops)
+    @need_gc = need_gc_stat?(@fmt_ops)
+    @clock = compile_clock(opts[:clock], @fmt_ops)
+    @mono_clock, @real_clock = if @clock == :coarse
+      [ Process::CLOCK_MONOTONIC_COARSE, Process::CLOCK_REALTIME_COARSE ]
+    else
+      [ defined?(Process::CLOCK_MONOTONIC) ? Process::CLOCK_MONOTONIC :
+        Process::CLOCK_REALTIME, Process::CLOCK_REALTIME ]
+    end
+    @max_line = opts[:max_line_length] and @max_line = Integer(@max_line)
+    @max_line.nil? || @max_line > 0 or
+      raise ArgumentError, ":max_line_length must be positive"
+    @trusted = opts[:trusted_proxies] and
+      @trusted = Array(@trusted).map { |cidr| trusted_proxy(cidr) }
     @body_bytes_sent = 0
+    @stats = Stats.new
+    @outputs and @outputs.each { |o| o.stats = @stats }
+    if opts[:index]
+      @log_file or raise ArgumentError, ":index needs a :path"
+      @log_file.open_index
+    end
+    size, interval = opts[:rotate_size], opts[:rotate_interval]
+    size || interval and init_rotation(size, interval)
+    @rid_env = opts[:request_id] and
+      @rid_env = true == @rid_env ? 'clogger.request_id' : @rid_env.to_str
+    init_path_template(opts[:path_patterns], opts[:path_template_cache])
+    @xs_utf8 = compile_escape(opts[:escape])
+    @lbuf = @fbuf = nil
+    buf = opts[:buffer] and init_line_buffer(buf, opts[:flush_interval])
+    @lbuf || !@log_file or init_fiber_buffer(opts[:flush_interval])
+    @dedup = nil
+    dedup = opts[:dedup] and init_dedup(dedup)
+    opts[:flight_recorder] && @outputs and
+      raise ArgumentError, ":flight_recorder goes in one of the :outputs"
+    @flight = fr = opts[:flight_recorder] and
+      @flight = FlightWriter.new(*compile_flight_recorder(fr))
+  end
+
+  # used by the parent when rendering :outputs
+  attr_reader :fmt_ops, :max_line, :cond, :logger, :log_file, :lbuf, :fbuf,
+              :dedup, :flight
+  attr_writer :stats
+  protected :fmt_ops, :max_line, :cond, :logger, :log_file, :lbuf, :fbuf,
+            :dedup, :flight, :stats=
+
+  LOG_FILE_RETRY = 60 # see log_file.h
+
+  # a :path we opened ourselves.  Reopening swaps +io+, writers which
+  # already grabbed the old one finish with it and the GC closes it.
+  class LogFile < Struct.new(:owner, :path, :io, :size, :rotate_size,
+                             :rotate_interval, :rotate_at, :rotating,
+                             :index, :index_sec, :end, :lines, :size_sec,
+                             :retry_at)
+    def initialize(owner, path, io)
+      super(owner, path, io)
+      arm
+    end
+
+    def arm
+      self.size = self.end = io.size
+      self.size_sec = Time.now.to_i
+      if rotate_interval
+        now = Time.now.to_i
+        self.rotate_at = now - now % rotate_interval + rotate_interval
+      end
+      self.rotating = false
+      self.retry_at = 0
+    end
+
+    def write(str)
+      io.write(str)
+      self.size += str.bytesize
+      due? or return
+      self.rotating = true
+      Clogger.rotate_later(owner)
+    end
+
+    # see log_file_due in log_file.h
+    def due?
+      return false if rotating || !(rotate_size || rotate_interval)
+      now = Time.now.to_i
+      return false if now < retry_at
+      if rotate_size
+        if now != size_sec
+          cur = io.size
+          self.size = cur if cur > size
+          self.size_sec = now
+        end
+        return true if size >= rotate_size
+      end
+      rotate_interval && now >= rotate_at
+    end
+
+    def rotate_failed
+      self.rotating = false
+      self.retry_at = Time.now.to_i + LOG_FILE_RETRY
+    end
+
+    def reopen
+      io = File.open(path, "ab")
+      io.sync = true
+      self.io = io
+      arm
+      index and open_index
+    end
+
+    def open_index
+      index and index.close
+      self.index, self.lines = Clogger::Index.open_writer(path)
+      self.index_sec = 0
+    end
+
+    # the first line each second gets an :index record
+    def note(bytes)
+      now = Time.now.to_i
+      if now > index_sec
+        off = [ io.size, self.end ].max
+        index.write([ now, off, lines ].pack(Clogger::Index::RECORD))
+        self.index_sec = now
+      end
+      self.end += bytes
+      self.lines += 1
+    end
+  end
+
+  def init_rotation(size, interval)
+    @log_file or raise ArgumentError, "rotation needs a :path"
+    if size
+      size = Integer(size)
+      size > 0 or raise ArgumentError, ":rotate_size must be positive"
+      @log_file.rotate_size = size
+    end
+    if interval
+      interval = Integer(interval)
+      interval > 0 or raise ArgumentError, ":rotate_interval must be positive"
+      @log_file.rotate_interval = interval
+    end
+    @log_file.arm
+  end
+  private :init_rotation
+
+  def reopen
+    [ self ].concat(@outputs || []).each do |o|
+      log_file = o.log_file and log_file.reopen
+    end
+    self
+  end
+
+  # our own :path only, for Clogger.reopen_all and #rotate
+  def reopen_path
+    @log_file and @log_file.reopen
+    self
+  end
+  private :reopen_path
+
+  def rotate_failed
+    @log_file and @log_file.rotate_failed
+  end
+  private :rotate_failed
+
+  # holds finished lines for :buffer and writes them out in chunks.
+  # +deferred+ ones (for fibers, see fiber_buffered?) are only written
+  # out by the flusher.
+  class LineBuffer < Struct.new(:io, :limit, :interval, :buf, :deadline,
+                                :pid, :lock, :deferred, :registered)
+    def initialize(io, limit, interval, deferred = false)
+      super(io, limit, interval, ''.b, nil, $$, Mutex.new, deferred)
+    end
+
+    # returns true if +str+ is the first line pending
+    def append(str, now, stats)
+      started = due = false
+      lock.synchronize do
+        if pid != $$ # lines inherited across fork belong to the parent
+          self.pid = $$
+          buf.clear
+        end
+        if buf.empty?
+          started = true
+          self.deadline = now + interval
+        end
+        buf << str
+        due = buf.bytesize >= limit || now >= deadline
+        write(stats) if due && !deferred
+      end
+      Clogger.start_flusher if started
+      Clogger.flush_soon if due && deferred
+      started
+    end
+
+    def pending?
+      !buf.empty?
+    end
+
+    def flush(stats)
+      lock.synchronize { write(stats) }
+    end
+
+    def write(stats)
+      return if buf.empty? || pid != $$
+      io.write(buf)
+      buf.clear
+      stats.wrote
+    end
+  end
+
+  LINE_BUFFER_SIZE = 65536 # :buffer => true
+
+  def init_line_buffer(size, interval)
+    size = true == size ? LINE_BUFFER_SIZE : Integer(size)
+    interval = interval ? Float(interval) : 1.0
+    @logger.respond_to?(:fileno) && @logger.fileno or
+      raise ArgumentError,
+            ":buffer needs a :path or a :logger with a file descriptor"
+    size > 0 or raise ArgumentError, ":buffer must be positive"
+    interval > 0 or raise ArgumentError, ":flush_interval must be positive"
+    @lbuf = LineBuffer.new(@log_file || @logger, size, interval)
+    Clogger.register_buffer(self, interval)
+  end
+
+  # only registered for flushing once a fiber logs something
+  def init_fiber_buffer(interval)
+    defined?(Fiber.scheduler) or return # Ruby < 3.0
+    interval = interval ? Float(interval) : 1.0
+    interval > 0 or raise ArgumentError, ":flush_interval must be positive"
+    @fbuf = LineBuffer.new(@log_file, LINE_BUFFER_SIZE, interval, true)
+  end
+
+  # lines logged from a non-blocking fiber would stall the scheduler's
+  # whole thread in write(2), so they're left to the background flusher.
+  # Once a line is in there, the ones after it follow to keep them in
+  # order.
+  def fiber_buffered?(fbuf)
+    fbuf.pending? || (Fiber.scheduler && !Fiber.current.blocking?)
+  end
+
+  private :init_line_buffer, :init_fiber_buffer, :fiber_buffered?
+
+  def init_dedup(dedup)
+    @log_file || @logger or raise ArgumentError, ":dedup needs a :path or :logger"
+    dedup = compile_dedup(dedup)
+    @dedup = Dedup.new(dedup)
+    Clogger.register_buffer(self, dedup_interval(dedup))
+  end
+  private :init_dedup
+
+  def flush(force = true)
+    now = mono_now
+    [ self ].concat(@outputs || []).each do |o|
+      dedup = o.dedup and
+        dedup.flush(force, now) { |line| emit(o, nil, line, now) }
+      lbuf = o.lbuf and lbuf.flush(@stats)
+      fbuf = o.fbuf and fbuf.flush(@stats)
+    end
+    self
+  end
+
+  # what $path_template logs for +path+.  The memo is a FIFO rather than
+  # path_template.h's direct-mapped table, but it's just as bounded.
+  def path_template(path)
+    path = path.to_str
+    cache = @path_cache if path.bytesize <= PATH_TEMPLATE_MEMO_MAX
+    cache and tpl = cache[path] and return tpl.dup
+    tpl = path.b.split('/', -1).map { |seg| path_segment(seg) }.join('/')
+    if cache
+      cache.shift if cache.size >= @path_cache_max
+      cache[path.dup.freeze] = tpl.dup.freeze
+    end
+    tpl
+  end
+
+  # :flight_recorder writer, see flight_recorder.h.  Without atomics on
+  # the mapping, the head and each slot are updated under flock(2) (and
+  # a Mutex, since threads share our fd), so don't share a file with
+  # writers using the C extension.
+  class FlightWriter
+    FR = FlightRecorder
+
+    def initialize(io, entries)
+      @io, @entries, @path, @pid = io, entries, io.path, $$
+      @lock = Mutex.new
+    end
+
+    def record(status, request_time, line)
+      len = line.end_with?("\n") ? line.bytesize - 1 : line.bytesize
+      len = FR::LINE_MAX if len > FR::LINE_MAX
+      slot = [ Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond),
+               (request_time * 1e9).to_i, $$,
+               Integer === status ? status & 0xffff : 0, len
+             ].pack(FR::SLOT[1..-1]) << line.byteslice(0, len)
+      @lock.synchronize do
+        if @pid != $$ # flock(2) locks are shared with our parent's fd
+          @io = File.open(@path, 'r+b')
+          @pid = $$
+        end
+        io = @io
+        io.flock(File::LOCK_EX)
+        begin
+          n = io.pread(8, FR::HEAD_OFF).unpack1('Q')
+          io.pwrite([ n + 1 ].pack('Q'), FR::HEAD_OFF)
+          off = FR::HEADER_SIZE + (n % @entries) * FR::SLOT_SIZE
+          io.pwrite([ n * 2 + 1 ].pack('Q'), off)
+          io.pwrite(slot, off + 8)
+          io.pwrite([ n * 2 + 2 ].pack('Q'), off)
+        ensure
+          io.flock(File::LOCK_UN)
+        end
+      end
+    end
   end
 
+  # :dedup state, one slot per PATH_INFO prefix, see dedup.h
+  class Dedup
+    LINE_MAX = 4096
+    Slot = Struct.new(:prefix, :window, :key, :deadline, :repeats,
+                      :line, :count_at)
+
+    def initialize(list)
+      @lock = Mutex.new
+      @slots = list.map { |prefix, window| Slot.new(prefix, window, nil, 0, 0) }
+    end
+
+    # returns true if +line+ repeats the last one written for its prefix
+    # within the window, otherwise yields the summary of the last run
+    def check(path, key, line, count_at, now)
+      path = path.to_s.b
+      slot = @slots.find { |s| path.start_with?(s.prefix) } or return false
+      summary = nil
+      @lock.synchronize do
+        if slot.key == key && now < slot.deadline &&
+           line.bytesize <= LINE_MAX
+          slot.repeats += 1
+          slot.line = line
+          slot.count_at = count_at
+          Clogger.start_flusher if slot.repeats == 1
+          return true
+        end
+        summary = summarize(slot)
+        slot.key = key
+        slot.deadline = now + slot.window
+      end
+      yield summary if summary
+      false
+    end
+
+    def flush(force, now)
+      summaries = @lock.synchronize do
+        @slots.map do |slot|
+          next if !force && now < slot.deadline
+          slot.key = nil
+          summarize(slot)
+        end
+      end
+      summaries.each { |line| yield line if line }
+    end
+
+    # the last suppressed line, with its $repeat_count
+    def summarize(slot)
+      slot.repeats == 0 and return
+      line, off, len = slot.line, *slot.count_at
+      if off && off + len <= line.bytesize
+        line = "#{line.byteslice(0, off)}#{slot.repeats}" \
+               "#{line.byteslice(off + len, line.bytesize)}"
+      end
+      slot.repeats = 0
+      line
+    end
+  end
+
+  # we can't see write(2) calls here, so a :path write counts as one
+  # counters for Clogger#stats and Clogger.stats.  Each thread bumps its
+  # own Counters without locking, LOCK only guards the list of them
+  # (registering a thread, summing, folding in dead threads).
+  class Stats
+    LOCK = Mutex.new
+    MAX = [ :format_time_max, :write_time_max, :log_buf_max ]
+
+    Counters = Struct.new(:lines, :bytes, :write_calls, :short_writes,
+                          :write_retries, :logger_lines,
+                          :format_time, :format_time_max,
+                          :write_time, :write_time_max, :log_buf_max,
+                          :suppressed) do
+      def initialize
+        super(0, 0, 0, 0, 0, 0, 0.0, 0.0, 0.0, 0.0, 0, 0)
+      end
+
+      def merge!(other)
+        each_pair do |k, v|
+          x = other[k]
+          self[k] = MAX.include?(k) ? (x > v ? x : v) : v + x
+        end
+        self
+      end
+    end
+
+    def initialize
+      @done = Counters.new # from threads which exited
+      @live = {} # Thread => Counters
+    end
+
+    # +sink+ is :path, :logger or nil for :buffer (see #wrote)
+    def update(bytes, format_time, write_time, sink)
+      [ mine, ALL.mine ].each do |st|
+        st.lines += 1
+        case sink
+        when :path then st.write_calls += 1
+        when :logger then st.logger_lines += 1
+        end
+        st.bytes += bytes
+        st.format_time += format_time
+        st.write_time += write_time
+        st.format_time_max = format_time if format_time > st.format_time_max
+        st.write_time_max = write_time if write_time > st.write_time_max
+        st.log_buf_max = bytes if bytes > st.log_buf_max
+      end
+    end
+
+    def wrote
+      mine.write_calls += 1
+      ALL.mine.write_calls += 1
+    end
+
+    def suppress
+      mine.suppressed += 1
+      ALL.mine.suppressed += 1
+    end
+
+    def to_h
+      LOCK.synchronize do
+        @live.each_value.inject(@done.dup) { |sum, st| sum.merge!(st) }.to_h
+      end
+    end
+
+    # the calling thread's Counters
+    def mine
+      h = Thread.current.thread_variable_get(:clogger_stats) and
+        st = h[self] and return st
+      LOCK.synchronize do
+        @live.delete_if { |thr, st| !thr.alive? && @done.merge!(st) }
+        st = @live[Thread.current] = Counters.new
+        h ||= Thread.current.thread_variable_set(:clogger_stats,
+                                                 {}.compare_by_identity)
+        h[self] = st
+      end
+    end
+
+    ALL = new
+  end
+
+  def self.stats
+    Stats::ALL.to_h
+  end
+
+  def stats
+    @stats.to_h
+  end
+
+  attr_reader :clock
+
   def call(env)
-    start = mono_now
+    start = req_now
+    @rid_env and env[@rid_env] = request_id(env)
+    input = count_input(env) if @need_input
+    usage = usage_now if @need_cpu || @need_gc
     resp = @app.call(env)
     unless resp.instance_of?(Array) && resp.size == 3
-      log(env, 500, {}, start)
+      log(env, 500, {}, start, input, usage)
       raise TypeError, "app response not a 3 element Array: #{resp.inspect}"
     end
     status, headers, body = resp
@@ -40,13 +516,15 @@ class Clogger
       @reentrant = env['rack.multithread'] if @reentrant.nil?
       wbody = @reentrant ? self.dup : self
       wbody.start = start
+      wbody.input = input
+      wbody.usage = usage
       wbody.env = env
       wbody.status = status
       wbody.headers = headers
       wbody.body = body
       return [ status, headers, wbody ]
     end
-    log(env, status, headers, start)
+    log(env, status, headers, start, input, usage)
     [ status, headers, body ]
   end
 
@@ -74,7 +552,8 @@ class Clogger
   end
 
   def fileno
-    @logger.respond_to?(:fileno) ? @logger.fileno : nil
+    io = @log_file ? @log_file.io : @logger
+    io.respond_to?(:fileno) ? io.fileno : nil
   end
 
   def respond_to?(method, include_all=false)
@@ -89,15 +568,93 @@ class Clogger
 
 private
 
+  def log_path
+    @log_file && @log_file.path
+  end
+
+  # well-formed UTF-8 minus the C1 controls, see escape.h
+  UTF8_SEQ = '\xC2[\xA0-\xBF]|[\xC3-\xDF][\x80-\xBF]|' \
+             '\xE0[\xA0-\xBF][\x80-\xBF]|' \
+             '[\xE1-\xEC\xEE\xEF][\x80-\xBF]{2}|\xED[\x80-\x9F][\x80-\xBF]|' \
+             '\xF0[\x90-\xBF][\x80-\xBF]{2}|[\xF1-\xF3][\x80-\xBF]{3}|' \
+             '\xF4[\x80-\x8F][\x80-\xBF]{2}'
+  XS_UTF8 = Regexp.new("(#{UTF8_SEQ})|['\"\\x00-\\x1f\\x7f-\\xff]".b,
+                       Regexp::NOENCODING)
+
   def byte_xs(s)
     s = s.dup
     s.force_encoding(Encoding::BINARY) if defined?(Encoding::BINARY)
-    s.gsub!(/(['"\x00-\x1f\x7f-\xff])/) do |x|
-      "\\x#{$1.unpack('H2').first.upcase}"
+    if @xs_utf8
+      s.gsub!(XS_UTF8) { |x| $1 || "\\x#{x.unpack('H2').first.upcase}" }
+    else
+      s.gsub!(/(['"\x00-\x1f\x7f-\xff])/) do |x|
+        "\\x#{$1.unpack('H2').first.upcase}"
+      end
     end
     s
   end
 
+  # decodes like Rack::Utils.unescape, avoids parsing every cookie
+  def cookie(env, key)
+    if cookies = env['rack.request.cookie_hash']
+      val = cookies[key] and return byte_xs(val)
+      return '-'
+    end
+    env['HTTP_COOKIE'].to_s.b.split(/[;,] */n).each do |pair|
+      k, v = pair.split('=', 2)
+      if k == key && v
+        v = v.tr('+', ' ')
+        v.gsub!(/%([0-9a-fA-F]{2})/) { [ $1.hex ].pack('C') }
+        return byte_xs(v)
+      end
+    end
+    '-'
+  end
+
+  # the first matching key wins, names are case-insensitive like nginx
+  def query_arg(env, key)
+    env['QUERY_STRING'].to_s.b.split('&').each do |pair|
+      k, v = pair.split('=', 2)
+      v && k.casecmp?(key) and return byte_xs(v)
+    end
+    '-'
+  end
+
+  # IPv4 is matched as IPv4-mapped IPv6 like cidr_trie.h does, so
+  # IPv6 prefixes such as ::/0 cover IPv4 peers, too
+  def trusted_proxy(cidr)
+    ipv6(IPAddr.new(cidr.to_s))
+  rescue ArgumentError
+    raise ArgumentError, "invalid trusted proxy: #{cidr}"
+  end
+
+  def ipv6(addr)
+    addr.ipv4? ? addr.ipv4_mapped : addr
+  end
+
+  # only what inet_pton(3) takes: IPAddr also parses "a/b" as a network,
+  # "fe80::1%eth0" and "[::1]", which cidr_trie.h never trusts
+  PLAIN_ADDR = /\A *[\h.:]+ *\z/
+
+  def trusted?(addr)
+    PLAIN_ADDR.match?(addr) or return false
+    addr = ipv6(IPAddr.new(addr.strip))
+    @trusted.any? { |net| net.include?(addr) }
+  rescue ArgumentError
+    false
+  end
+
+  def real_ip(env)
+    remote = env['REMOTE_ADDR'] || '-'
+    @trusted && trusted?(remote) or return remote
+    env['HTTP_X_FORWARDED_FOR'].to_s.split(',').reverse_each do |addr|
+      trusted?(addr) and next
+      addr = addr.strip
+      addr.empty? or return byte_xs(addr)
+    end
+    remote
+  end
+
   SPECIAL_RMAP = SPECIAL_VARS.inject([]) { |ary, (k,v)| ary[v] = k; ary }
 
   def request_uri(env)
@@ -107,7 +664,19 @@ private
     "#{byte_xs(env['PATH_INFO'])}#{qs}"
   end
 
-  def special_var(special_nr, env, status, headers)
+  # never call rack.input.size, it may force the body to be buffered
+  def count_input(env)
+    cl = env['CONTENT_LENGTH'] and cl != '' and return
+    input = env['rack.input'] or return
+    env['rack.input'] = InputCounter.new(input)
+  end
+
+  def request_length(env, input)
+    cl = env['CONTENT_LENGTH'] and cl != '' and return byte_xs(cl)
+    input ? input.bytes_read.to_s : '-'
+  end
+
+  def special_var(special_nr, env, status, headers, input, usage)
     case SPECIAL_RMAP[special_nr]
     when :body_bytes_sent
       @body_bytes_sent.to_s
@@ -123,14 +692,27 @@ private
     when :request_uri
       request_uri(env)
     when :request_length
-      env['rack.input'].size.to_s
+      request_length(env, input)
     when :response_length
       @body_bytes_sent == 0 ? '-' : @body_bytes_sent.to_s
     when :ip
       xff = env['HTTP_X_FORWARDED_FOR'] and return byte_xs(xff)
       env['REMOTE_ADDR'] || '-'
+    when :real_ip
+      real_ip(env)
     when :pid
       $$.to_s
+    when :gc_count
+      (GC.count - usage[1]).to_s
+    when :allocated_objects
+      (GC.stat(:total_allocated_objects) - usage[3]).to_s
+    when :repeat_count
+      '1'
+    when :request_id
+      @rid_env ? env[@rid_env] : (@rid ||= request_id(env))
+    when :path_template
+      path = env['PATH_INFO']
+      String === path ? byte_xs(path_template(path)) : '-'
     when :time_iso8601
       Time.now.iso8601
     when :time_local
@@ -150,40 +732,257 @@ private
     end
   end
 
+  PATH_TEMPLATE_CACHE = 1024 # see path_template.h
+  PATH_TEMPLATE_MEMO_MAX = 4096 # longer paths aren't memoized
+
+  def init_path_template(patterns, size)
+    @path_patterns = compile_path_patterns(patterns)
+    size = size ? Integer(size) : PATH_TEMPLATE_CACHE
+    size >= 0 or raise ArgumentError, ":path_template_cache must not be negative"
+    @path_cache_max = size
+    @path_cache = size > 0 ? {} : nil
+  end
+  private :init_path_template
+
+  UUID_SEG = /\A\h{8}-\h{4}-\h{4}-\h{4}-\h{12}\z/
+
+  def path_segment(seg)
+    seg.empty? and return seg
+    @path_patterns.each { |re, ph| re.match?(seg) and return ph }
+    case seg
+    when /\A\d+\z/ then ':id'
+    when UUID_SEG then ':uuid'
+    when /\A\h{8,}\z/ then seg =~ /\d/ ? ':hex' : seg
+    else seg
+    end
+  end
+  private :path_segment
+  REQUEST_ID_RE = %r{\A[a-zA-Z0-9_.:+/=@-]{1,128}\z}
+
+  def request_id(env)
+    id = env['HTTP_X_REQUEST_ID']
+    String === id && REQUEST_ID_RE.match?(id) ? id : Clogger.next_request_id
+  end
+
+  @rid_pid = nil
+  @rid_lock = Mutex.new
+
+  # a random per-process prefix and a counter, see request_id.h
+  def self.next_request_id
+    @rid_lock.synchronize do
+      if @rid_pid != $$
+        @rid_pid = $$
+        @rid_prefix = rand(1 << 64)
+        @rid_seq = rand(1 << 32)
+      end
+      seq = @rid_seq
+      @rid_seq = (seq + 1) & 0xffff_ffff_ffff_ffff
+      sprintf('%016x%016x', @rid_prefix, seq)
+    end
+  end
+
   def time_format(sec, usec, format, div)
     format % [ sec, usec / div ]
   end
 
-  def log(env, status, headers, start = @start)
-    str = @fmt_ops.map { |op|
-      case op[0]
-      when OP_LITERAL; op[1]
-      when OP_REQUEST; byte_xs(env[op[1]] || "-")
-      when OP_RESPONSE; byte_xs(headers[op[1]] || "-")
-      when OP_SPECIAL; special_var(op[1], env, status, headers)
-      when OP_EVAL; eval(op[1]).to_s rescue "-"
-      when OP_TIME_LOCAL; Time.now.strftime(op[1])
-      when OP_TIME_UTC; Time.now.utc.strftime(op[1])
-      when OP_REQUEST_TIME
-        t = mono_now - start
-        time_format(t.to_i, (t - t.to_i) * 1000000, op[1], op[2])
-      when OP_TIME
-        t = Time.now
-        time_format(t.to_i, t.usec, op[1], op[2])
-      when OP_COOKIE
-        (byte_xs(env['rack.request.cookie_hash'][op[1]]) rescue "-") || "-"
+  TRUNC_MARK = '...'
+
+  # don't leave half of a "\xXX" escape (or, with :escape => :utf8, of a
+  # character) behind after truncating
+  def trim_escape(s)
+    n = s.bytesize
+    if s.end_with?('\\')
+      n -= 1
+    elsif s.end_with?('\\x')
+      n -= 2
+    elsif n >= 3 && s.byteslice(n - 3, 2) == '\\x'
+      n -= 3
+    elsif @xs_utf8
+      n = utf8_trim(s.b, n)
+    end
+    s.byteslice(0, n)
+  end
+
+  # see utf8_trim in escape.h
+  def utf8_trim(s, n)
+    i = n
+    i -= 1 while i > 0 && i > n - 4 && (s.getbyte(i - 1) & 0xc0) == 0x80
+    i == 0 || (lead = s.getbyte(i - 1)) < 0xc0 and return n
+    n - (i - 1) < (lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2) ? i - 1 : n
+  end
+
+  # {N} holds at most N bytes, TRUNC_MARK included
+  def truncate_field(s, max)
+    s.bytesize > max or return s
+    keep = max - TRUNC_MARK.bytesize
+    s = trim_escape(s.byteslice(0, keep < 0 ? 0 : keep))
+    "#{s}#{TRUNC_MARK.byteslice(0, max - s.bytesize)}"
+  end
+
+  def truncate_line(parts, ops, max_line)
+    tail = OP_LITERAL == ops.last[0] ? parts.pop : ''
+    line = parts.join('')
+    room = max_line - tail.bytesize
+    if line.bytesize > room
+      room -= TRUNC_MARK.size
+      line = line.byteslice(0, room < 0 ? 0 : room)
+      line = "#{trim_escape(line)}#{TRUNC_MARK}"
+    end
+    line << tail
+  end
+
+  def log(env, status, headers, start = @start, input = @input, usage = @usage)
+    @rid = nil # $request_id without :request_id, picked once per request
+    # escaped values shared by all :outputs
+    cache = @outputs ? {} : nil
+    (@outputs || [ self ]).each do |o|
+      cond = o.cond and (cond.call(env, status) or next)
+      t0 = mono_now
+      parts = o.fmt_ops.map { |op|
+        args = [ op, env, status, headers, start, input, usage ]
+        val = if cache && CACHEABLE_OPS.include?(op[0])
+          cache[op[0, 2]] ||= value(*args)
+        else
+          value(*args)
+        end
+        max = CAPPABLE_OPS.include?(op[0]) && op[2]
+        max ? truncate_field(val, max) : val
+      }
+      max_line = o.max_line
+      str = if max_line
+        truncate_line(parts.dup, o.fmt_ops, max_line)
       else
-        raise "EDOOFUS #{op.inspect}"
+        parts.join('')
       end
-    }.join('')
+      t1 = mono_now
+      fr = o.flight and fr.record(status, req_now - start, str)
 
-    l = @logger
-    if l
+      if dedup = o.dedup
+        key, count_at, off = [], nil, 0
+        o.fmt_ops.each_with_index do |op, i|
+          if OP_SPECIAL == op[0] && SPECIAL_VARS[:repeat_count] == op[1]
+            count_at = [ off, parts[i].bytesize ]
+          end
+          volatile_op?(op) or key << parts[i]
+          off += parts[i].bytesize
+        end
+        path = env['PATH_INFO']
+        if dedup.check(path, key.join('').hash, str, count_at, t1) { |line|
+             emit(o, env, line, t1)
+           }
+          @stats.suppress
+          next
+        end
+      end
+      emit(o, env, str, t1, t1 - t0)
+    end
+    nil
+  end
+
+  # writes +str+ to the sink of output +o+
+  def emit(o, env, str, t1, format_time = 0.0)
+    log_file = o.log_file and log_file.index and log_file.note(str.bytesize)
+    l = o.logger
+    if lbuf = o.lbuf
+      lbuf.append(str, t1, @stats)
+      sink = nil
+    elsif (fbuf = o.fbuf) && fiber_buffered?(fbuf)
+      if fbuf.append(str, t1, @stats) && !fbuf.registered
+        fbuf.registered = true
+        Clogger.register_buffer(o, fbuf.interval)
+      end
+      sink = nil
+    elsif log_file = o.log_file
+      log_file.write(str)
+      sink = :path
+    elsif l
       l << str
+      sink = :logger
     else
       env['rack.errors'].write(str)
+      sink = :logger
     end
-    nil
+    @stats.update(str.bytesize, format_time, mono_now - t1, sink)
+  end
+
+  VOLATILE_SPECIALS = SPECIAL_VARS.values_at(:time_iso8601, :time_local,
+                                             :time_utc, :gc_count,
+                                             :allocated_objects,
+                                             :repeat_count, :request_id)
+
+  # variables which differ between otherwise identical requests
+  def volatile_op?(op)
+    case op[0]
+    when OP_TIME_LOCAL, OP_TIME_UTC, OP_REQUEST_TIME, OP_TIME,
+         OP_CPU_TIME, OP_GC_TIME
+      true
+    when OP_SPECIAL
+      VOLATILE_SPECIALS.include?(op[1])
+    else
+      false
+    end
+  end
+
+  CACHEABLE_OPS = [ OP_REQUEST, OP_RESPONSE, OP_SPECIAL, OP_COOKIE, OP_ARG ]
+
+  def value(op, env, status, headers, start, input, usage)
+    case op[0]
+    when OP_LITERAL; op[1]
+    when OP_REQUEST; byte_xs(env[op[1]] || "-")
+    when OP_RESPONSE; byte_xs(headers[op[1]] || "-")
+    when OP_SPECIAL
+      special_var(op[1], env, status, headers, input, usage)
+    when OP_EVAL; eval(op[1]).to_s rescue "-"
+    when OP_TIME_LOCAL; Time.now.strftime(op[1])
+    when OP_TIME_UTC; Time.now.utc.strftime(op[1])
+    when OP_REQUEST_TIME
+      t = req_now - start
+      time_format(t.to_i, (t - t.to_i) * 1000000, op[1], op[2])
+    when OP_TIME
+      t = Process.clock_gettime(@real_clock, :microsecond)
+      time_format(t / 1000000, t % 1000000, op[1], op[2])
+    when OP_CPU_TIME
+      if usage[0]
+        t = cpu_now - usage[0]
+        time_format(t.to_i, (t - t.to_i) * 1000000, op[1], op[2])
+      else
+        '-'
+      end
+    when OP_GC_TIME
+      if usage[2]
+        ms = gc_time_now - usage[2]
+        time_format(ms / 1000, (ms % 1000) * 1000, op[1], op[2])
+      else
+        '-'
+      end
+    when OP_COOKIE; cookie(env, op[1])
+    when OP_ARG; query_arg(env, op[1])
+    else
+      raise "EDOOFUS #{op.inspect}"
+    end
+  end
+
+  if defined?(Process::CLOCK_THREAD_CPUTIME_ID)
+    def cpu_now; Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID); end
+  else
+    def cpu_now; end
+  end
+
+  # GC.stat(:time) is Ruby 3.1+, milliseconds
+  if GC.stat.key?(:time)
+    def gc_time_now; GC.stat(:time); end
+  else
+    def gc_time_now; end
+  end
+
+  # [ cpu_time, gc_count, gc_time, total_allocated_objects ]
+  def usage_now
+    [ cpu_now, GC.count, gc_time_now, GC.stat(:total_allocated_objects) ]
+  end
+
+  # $request_time, from the :clock we picked
+  def req_now
+    Process.clock_gettime(@mono_clock)
   end
 
   # favor monotonic clock if possible, and try to use clock_gettime in
@@ -196,3 +995,45 @@ private
     def mono_now; Time.now.to_f; end
   end
 end
+
+# the same splitting rules as the C extension, without mmap or threads
+class Clogger::Parser
+  def self.unescape(field)
+    field.b.gsub(/\\x([0-9A-Fa-f]{2})/n) { $1.hex.chr }
+  end
+
+  def parse_line(line)
+    line = line.b.delete_suffix("\n")
+    lit = @literals
+    line.start_with?(lit[0]) or return
+    pos = lit[0].bytesize
+    return pos == line.bytesize ? [] : nil if @fields.empty?
+    rv = []
+    1.upto(@fields.size - 1) do |i|
+      q = line.byteindex(lit[i], pos) or return
+      rv << line.byteslice(pos, q - pos)
+      pos = q + lit[i].bytesize
+    end
+    tail = lit[-1]
+    line.bytesize - pos >= tail.bytesize && line.end_with?(tail) or return
+    rv << line.byteslice(pos, line.bytesize - pos - tail.bytesize)
+  end
+
+  def each(path)
+    block_given? or return enum_for(__method__, path)
+    File.open(path, 'rb') do |fp|
+      fp.each_line { |line| fields = parse_line(line) and yield fields }
+    end
+    self
+  end
+
+private
+
+  def tally_index(path, idx, threads)
+    idx < @fields.size or raise ArgumentError, "no variable at #{idx}"
+    rv = Hash.new(0)
+    each(path) { |fields| rv[fields[idx]] += 1 }
+    rv.default = nil
+    rv
+  end
+end
@@ -5,6 +5,7 @@ require "time"
 require "date"
 require "stringio"
 require "tempfile"
+require "tmpdir"
 
 require "rack"
 
@@ -217,6 +218,99 @@ class TestClogger < Test::Unit::TestCase
     assert_equal "[#$$]\n", str.string
   end
 
+  def test_request_id
+    str = StringIO.new
+    seen = nil
+    app = lambda { |env| seen = env['clogger.request_id']; [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$request_id',
+                     :request_id => true)
+    3.times { cl.call(@req.dup) }
+    ids = str.string.split("\n")
+    assert_equal 3, ids.uniq.size
+    ids.each { |id| assert_match %r{\A[0-9a-f]{32}\z}, id }
+    assert_equal 1, ids.map { |id| id[0, 16] }.uniq.size
+    assert_equal ids[2], seen
+
+    str = StringIO.new
+    cl = Clogger.new(app, :logger => str, :format => '$request_id',
+                     :request_id => true)
+    cl.call(@req.merge('HTTP_X_REQUEST_ID' => 'abc-123@lb:1'))
+    assert_equal 'abc-123@lb:1', seen
+    cl.call(@req.merge('HTTP_X_REQUEST_ID' => "bad\"id"))
+    cl.call(@req.merge('HTTP_X_REQUEST_ID' => 'x' * 129))
+    lines = str.string.lines
+    assert_equal "abc-123@lb:1\n", lines[0]
+    assert_match %r{\A[0-9a-f]{32}\n\z}, lines[1]
+    assert_match %r{\A[0-9a-f]{32}\n\z}, lines[2]
+
+    # same ID in every output, without touching env
+    a, b = StringIO.new, StringIO.new
+    cl = Clogger.new(lambda { |env| [ 200, env, [] ] }, :outputs => [
+      { :format => '$request_id', :logger => a },
+      { :format => '$request_id $status', :logger => b },
+    ])
+    env = cl.call(@req.dup)[1]
+    assert_nil env['clogger.request_id']
+    assert_equal "#{a.string.chomp} 200\n", b.string
+
+    # same ID everywhere in one line, too
+    str = StringIO.new
+    twice = Clogger.new(app, :logger => str,
+                        :format => '$request_id $request_id')
+    twice.call(@req.dup)
+    x, y = str.string.split
+    assert_match %r{\A[0-9a-f]{32}\z}, x
+    assert_equal x, y
+
+    # a new prefix after fork
+    rd, wr = IO.pipe
+    pid = fork do
+      rd.close
+      cl.call(@req.dup)
+      wr.write(a.string.lines[-1])
+      exit!(0)
+    end
+    wr.close
+    child = rd.read
+    Process.waitpid(pid)
+    assert_not_equal a.string[0, 16], child[0, 16]
+  end
+
+  def test_path_template
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$path_template',
+                     :path_patterns => { /\A[a-z]+-[a-z]+\z/ => ':slug' })
+    {
+      '/users/123/orders/0f8fad5b-d9cb-469f-a165-70867728950e' =>
+        '/users/:id/orders/:uuid',
+      '/blobs/deadbeef1234/raw' => '/blobs/:hex/raw',
+      '/blobs/deadbeef/raw' => '/blobs/deadbeef/raw',
+      '/posts/hello-world/' => '/posts/:slug/',
+      '/a//7' => '/a//:id',
+      '/' => '/',
+      '' => '',
+      '/x"y/1' => '/x\\x22y/:id',
+      '/a' * 2048 + '/1' => '/a' * 2048 + '/:id', # too long to memoize
+    }.each do |path, expect|
+      str.truncate(0)
+      str.rewind
+      2.times { cl.call(@req.merge('PATH_INFO' => path)) } # memo hit
+      assert_equal "#{expect}\n" * 2, str.string, path
+      assert_equal expect.sub('\\x22', '"'), cl.path_template(path)
+    end
+
+    cl = Clogger.new(app, :logger => str, :format => '$path_template',
+                     :path_template_cache => 0)
+    assert_equal '/posts/hello-world/:id', cl.path_template('/posts/hello-world/1')
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => str, :path_patterns => { 'x' => ':x' })
+    }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => str, :path_patterns => { /x/ => 'a/b' })
+    }
+  end
+
   def test_rack_xff
     str = StringIO.new
     app = lambda { |env| [ 302, {}, [] ] }
@@ -309,8 +403,60 @@ class TestClogger < Test::Unit::TestCase
     input = StringIO.new('.....')
     app = lambda { |env| [ 200, {}, [] ] }
     cl = Clogger.new(app, :logger => str, :format => '$request_length')
-    status, header, bodies = cl.call(@req.merge('rack.input' => input))
+    req = @req.merge('rack.input' => input, 'CONTENT_LENGTH' => '5')
+    status, header, bodies = cl.call(req)
     assert_equal "5\n", str.string
+    assert_same input, req['rack.input']
+  end
+
+  def test_request_length_chunked
+    str = StringIO.new
+    input = StringIO.new("a\nbb\nccc")
+    def input.size
+      raise "size must not be called"
+    end
+    app = lambda { |env|
+      i = env['rack.input']
+      i.gets
+      i.rewind
+      i.read(2)
+      i.read
+      [ 200, {}, [] ]
+    }
+    cl = Clogger.new(app, :logger => str, :format => '$request_length')
+    status, header, bodies = cl.call(@req.merge('rack.input' => input))
+    assert_equal "8\n", str.string
+  end
+
+  def test_request_length_unread
+    str = StringIO.new
+    input = StringIO.new('.....')
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$request_length')
+    status, header, bodies = cl.call(@req.merge('rack.input' => input))
+    assert_equal "0\n", str.string
+  end
+
+  def test_request_length_no_input
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$request_length')
+    req = @req.dup
+    req.delete('rack.input')
+    status, header, bodies = cl.call(req)
+    assert_equal "-\n", str.string
+  end
+
+  def test_request_length_not_wrapped
+    str = StringIO.new
+    input = StringIO.new('.....')
+    app = lambda { |env|
+      assert_same input, env['rack.input']
+      [ 200, {}, [] ]
+    }
+    cl = Clogger.new(app, :logger => str, :format => '$status')
+    status, header, bodies = cl.call(@req.merge('rack.input' => input))
+    assert_equal "200\n", str.string
   end
 
   def test_response_length_0
@@ -431,6 +577,367 @@ class TestClogger < Test::Unit::TestCase
     assert_equal "bar h\\x7F&m\n", str.string
   end
 
+  def test_cookies_unparsed
+    str = StringIO.new
+    app = lambda { |env| [ 302, {}, [] ] }
+    cl = Clogger.new(app,
+        :format => '$cookie_foo $cookie_quux $cookie_sp $cookie_dup ' \
+                   '$cookie_q $cookie_none',
+        :logger => str)
+    cookie = "foobar=x;foo=bar;quux=h%7F&m; sp=a+b%2B,dup=1;  dup=2;q=\"%"
+    status, headers, body = cl.call(@req.merge('HTTP_COOKIE' => cookie))
+    assert_equal "bar h\\x7F&m a b+ 1 \\x22% -\n", str.string
+    assert_nil @req['rack.request.cookie_hash']
+  end
+
+  def test_cookies_unparsed_utf8
+    str = StringIO.new
+    app = lambda { |env| [ 302, {}, [] ] }
+    cl = Clogger.new(app, :format => '$cookie_foo', :logger => str)
+    cookie = "foo=\xff%7E".force_encoding(Encoding::UTF_8)
+    status, headers, body = cl.call(@req.merge('HTTP_COOKIE' => cookie))
+    assert_equal "\\xFF~\n", str.string
+  end
+
+  def test_cookies_unparsed_no_header
+    str = StringIO.new
+    app = lambda { |env| [ 302, {}, [] ] }
+    cl = Clogger.new(app, :format => '$cookie_foo', :logger => str)
+    status, headers, body = cl.call(@req)
+    assert_equal "-\n", str.string
+  end
+
+  def test_query_args
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app,
+        :format => '$arg_utm_source|$arg_page|$arg_q|$arg_e|$arg_x|$arg_a',
+        :logger => str)
+    qs = "xutm_source=no&UTM_Source=news%20letter&page=2&page=3&" \
+         "q=\"hi\"\xff&e=&x"
+    status, headers, body = cl.call(@req.merge('QUERY_STRING' => qs))
+    assert_equal "news%20letter|2|\\x22hi\\x22\\xFF||-|-\n", str.string
+  end
+
+  def test_query_args_utf8
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :format => '$arg_page|$arg_q', :logger => str)
+    qs = "\xff=1&q=\xff&Page=2".force_encoding(Encoding::UTF_8)
+    status, headers, body = cl.call(@req.merge('QUERY_STRING' => qs))
+    assert_equal "2|\\xFF\n", str.string
+  end
+
+  def test_query_args_no_query
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :format => '$arg_page', :logger => str)
+    req = @req.dup
+    req.delete('QUERY_STRING')
+    status, headers, body = cl.call(req)
+    assert_equal "-\n", str.string
+  end
+
+  def test_real_ip
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$real_ip',
+                     :trusted_proxies => %w(10.0.0.0/8 127.0.0.1 fd00::/8))
+    req = @req.merge('REMOTE_ADDR' => '10.1.2.3')
+    [
+      [ "1.2.3.4, 127.0.0.1,10.9.9.9", "1.2.3.4" ],
+      [ "6.6.6.6, 1.2.3.4 , fd00::1", "1.2.3.4" ],
+      [ "2001:db8::1, ::ffff:10.0.0.1", "2001:db8::1" ],
+      [ "garbage\", 10.0.0.1", "garbage\\x22" ],
+      [ "10.0.0.2, 127.0.0.1", "10.1.2.3" ],
+      [ "1.2.3.4, 10.9.9.9/8", "10.9.9.9/8" ],
+      [ "1.2.3.4, [fd00::1]", "[fd00::1]" ],
+      [ "1.2.3.4, fd00::1%eth0", "fd00::1%eth0" ],
+      [ ", ,", "10.1.2.3" ],
+      [ nil, "10.1.2.3" ],
+    ].each do |xff, expect|
+      str.truncate(0)
+      str.rewind
+      cl.call(req.merge('HTTP_X_FORWARDED_FOR' => xff))
+      assert_equal "#{expect}\n", str.string, xff.inspect
+    end
+  end
+
+  def test_real_ip_untrusted_peer
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$real_ip',
+                     :trusted_proxies => %w(10.0.0.0/8))
+    req = @req.merge('REMOTE_ADDR' => '1.2.3.4',
+                     'HTTP_X_FORWARDED_FOR' => '6.6.6.6')
+    cl.call(req)
+    assert_equal "1.2.3.4\n", str.string
+  end
+
+  def test_real_ip_ipv6_prefix_covers_ipv4
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    req = @req.merge('REMOTE_ADDR' => '10.1.1.1',
+                     'HTTP_X_FORWARDED_FOR' => '1.2.3.4, 10.0.0.1')
+    [
+      [ %w(::/0), "10.1.1.1" ], # all trusted, so the peer
+      [ %w(::ffff:10.0.0.0/104), "1.2.3.4" ],
+      [ %w(::ffff:10.0.0.0/120), "10.1.1.1" ],
+    ].each do |trusted, expect|
+      str.truncate(0)
+      str.rewind
+      cl = Clogger.new(app, :logger => str, :format => '$real_ip',
+                       :trusted_proxies => trusted)
+      cl.call(req)
+      assert_equal "#{expect}\n", str.string, trusted.inspect
+    end
+  end
+
+  def test_real_ip_no_trusted_proxies
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$real_ip')
+    cl.call(@req.merge('HTTP_X_FORWARDED_FOR' => '6.6.6.6'))
+    assert_equal "home\n", str.string
+  end
+
+  def test_real_ip_invalid_proxy
+    app = lambda { |env| [ 200, {}, [] ] }
+    %w(10.0.0.0/33 bogus ::1/129 10.0.0.0/).each do |bad|
+      assert_raise(ArgumentError, bad) do
+        Clogger.new(app, :format => '$real_ip', :trusted_proxies => [ bad ])
+      end
+    end
+  end
+
+  def test_compile_field_cap
+    cl = Clogger.new(nil, :format => '$http_user_agent{4}')
+    ary = nil
+    cl.instance_eval { ary = compile_format('$http_user_agent{4} $status{3}') }
+    expect = [
+      [ Clogger::OP_REQUEST, "HTTP_USER_AGENT", 4 ],
+      [ Clogger::OP_LITERAL, " " ],
+      [ Clogger::OP_SPECIAL, Clogger::SPECIAL_VARS[:status], 3 ],
+      [ Clogger::OP_LITERAL, "\n" ],
+    ]
+    assert_equal expect, ary
+    assert_raise(ArgumentError) { Clogger.new(nil, :format => '$msec{3}') }
+  end
+
+  def test_field_cap
+    str = StringIO.new
+    app = lambda { |env| [ 200, { 'X-Foo' => 'a' * 9 }, [] ] }
+    fmt = '$http_user_agent{7}|$http_x{5}|$http_y{4}|$sent_http_x_foo{8}|' \
+          '$request{8}|$cookie_a{3}|$arg_q{2}|$http_user_agent{100}'
+    cl = Clogger.new(app, :logger => str, :format => fmt)
+    req = @req.merge('HTTP_X' => 'ab"cd', 'HTTP_Y' => 'abcd',
+                     'HTTP_COOKIE' => 'a=%22%22', 'QUERY_STRING' => 'q=abc')
+    cl.call(req)
+    expect = 'echo...|ab...|abcd|aaaaa...|GET /...|...|..|' \
+             "echo and socat \\o/\n"
+    assert_equal expect, str.string
+  end
+
+  def test_max_line_length
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :max_line_length => 10,
+                     :format => '$http_user_agent $status')
+    cl.call(@req)
+    assert_equal "echo a...\n", str.string
+
+    str = StringIO.new
+    cl = Clogger.new(app, :logger => str, :max_line_length => 6,
+                     :format => '$status')
+    cl.call(@req)
+    assert_equal "200\n", str.string
+
+    str = StringIO.new
+    cl = Clogger.new(app, :logger => str, :max_line_length => 6,
+                     :format => '$http_x')
+    cl.call(@req.merge('HTTP_X' => '1"3456'))
+    assert_equal "1...\n", str.string
+
+    # bytes of a trimmed escape don't count against the line
+    [ false, true ].each do |snapshot|
+      str = StringIO.new
+      cl = Clogger.new(app, :logger => str, :max_line_length => 9,
+                       :format => '$http_x{7}', :snapshot => snapshot)
+      cl.call(@req.merge('HTTP_X' => "\xFF\xFF"))
+      assert_equal "\\xFF...\n", str.string
+    end
+
+    assert_raise(ArgumentError) do
+      Clogger.new(app, :logger => str, :max_line_length => 0)
+    end
+  end
+
+  def test_outlier_line
+    str = []
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :format => '$http_x')
+    cl.call(@req.merge('HTTP_X' => 'x' * 65536))
+    cl.call(@req.merge('HTTP_X' => 'y'))
+    assert_equal 65537, str[0].size
+    assert_equal "y\n", str[1]
+  end
+
+  def test_cpu_time
+    str = StringIO.new
+    app = lambda { |env|
+      t = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+      begin
+        x = 0
+        1000.times { x += 1 }
+      end while Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) < t + 0.02
+      [ 200, {}, [] ]
+    }
+    cl = Clogger.new(app, :logger => str, :format => '$cpu_time $cpu_time{6}')
+    assert cl.wrap_body?
+    cl.call(@req).last.close
+    assert_match %r{\A\d+\.\d{3} \d+\.\d{6}\n\z}, str.string
+    a, b = str.string.split.map(&:to_f)
+    assert_operator a, :>=, 0.02
+    assert_operator b, :>=, a
+  end if defined?(Process::CLOCK_THREAD_CPUTIME_ID)
+
+  def test_gc_stats
+    str = StringIO.new
+    app = lambda { |env|
+      1000.times { "" << "a" }
+      2.times { GC.start }
+      [ 200, {}, [] ]
+    }
+    cl = Clogger.new(app, :logger => str,
+                     :format => '$gc_count $allocated_objects $gc_time{1}')
+    assert cl.wrap_body?
+    cl.call(@req).last.close
+    gc_count, allocated, gc_time = str.string.split
+    assert_operator gc_count.to_i, :>=, 2
+    assert_operator allocated.to_i, :>=, 1000
+    assert_match %r{\A(?:\d+\.\d|-)\z}, gc_time
+  end
+
+  def test_stats
+    tmp = Tempfile.new('test_clogger')
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :format => '$status', :path => tmp.path)
+    before = Clogger.stats
+    st = cl.stats
+    assert_equal 0, st[:lines]
+    assert_equal 0, st[:log_buf_max]
+    2.times { cl.call(@req) }
+    st = cl.stats
+    assert_equal 2, st[:lines]
+    assert_equal 8, st[:bytes]
+    assert_equal 4, st[:log_buf_max]
+    assert_equal 0, st[:logger_lines]
+    assert_operator st[:format_time], :>=, st[:format_time_max]
+    assert_operator st[:write_time], :>=, st[:write_time_max]
+    assert_kind_of Float, st[:write_time]
+    assert_equal 2, st[:write_calls]
+    assert_equal 0, st[:short_writes]
+    assert_equal 0, st[:write_retries]
+    after = Clogger.stats
+    assert_equal before[:lines] + 2, after[:lines]
+    assert_equal st.keys, after.keys
+  end
+
+  def test_stats_reentrant_logger
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :format => '$request_time', :logger => str,
+                     :reentrant => true)
+    3.times { cl.call(@req).last.close }
+    st = cl.stats
+    assert_equal 3, st[:lines]
+    assert_equal 3, st[:logger_lines]
+    assert_equal str.string.size, st[:bytes]
+
+    # threads count separately, including ones which have exited
+    4.times.map {
+      Thread.new { 5.times { cl.call(@req).last.close } }
+    }.each(&:join)
+    Thread.new { cl.call(@req).last.close }.join
+    st = cl.stats
+    assert_equal 24, st[:lines]
+    assert_equal str.string.size, st[:bytes]
+  end
+
+  def test_if
+    str = StringIO.new
+    app = lambda { |env| [ env['HTTP_X'].to_i, {}, [] ] }
+    cond = lambda { |env, status| status >= 500 }
+    cl = Clogger.new(app, :logger => str, :format => '$status', :if => cond)
+    cl.call(@req.merge('HTTP_X' => '200'))
+    cl.call(@req.merge('HTTP_X' => '503'))
+    assert_equal "503\n", str.string
+    assert_equal 1, cl.stats[:lines]
+    assert_raise(ArgumentError) { Clogger.new(app, :if => true) }
+  end
+
+  def test_outputs
+    a, b, c = StringIO.new, StringIO.new, StringIO.new
+    app = lambda { |env| [ env['HTTP_X'].to_i, { 'X-Foo' => 'a"b' }, [] ] }
+    cl = Clogger.new(app, :outputs => [
+      { :logger => a, :format => '$status $http_user_agent $sent_http_x_foo' },
+      { :logger => b, :format => '{"ua":"$http_user_agent{7}","foo":' \
+                                 '"$sent_http_x_foo{4}"}' },
+      { :logger => c, :format => '$status $request_uri',
+        :if => lambda { |env, status| status >= 500 } },
+    ])
+    cl.call(@req.merge('HTTP_X' => '200'))
+    cl.call(@req.merge('HTTP_X' => '500'))
+    assert_equal "200 echo and socat \\o/ a\\x22b\n" \
+                 "500 echo and socat \\o/ a\\x22b\n", a.string
+    assert_equal %Q({"ua":"echo...","foo":"a..."}\n) * 2, b.string
+    assert_equal "500 /hello?goodbye=true\n", c.string
+    assert_equal 5, cl.stats[:lines]
+  end
+
+  def test_outputs_lookup_raises
+    a, b = StringIO.new, StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :outputs => [
+      { :logger => a, :format => '$cookie_foo{5} $status' },
+      { :logger => b, :format => '$cookie_foo' },
+    ])
+    bad = Hash.new { |h, k| raise 'boom' }
+    assert_raises(RuntimeError) {
+      cl.call(@req.merge('rack.request.cookie_hash' => bad))
+    }
+    cl.call(@req.merge('rack.request.cookie_hash' => { 'foo' => 'barbaz' }))
+    assert_equal "ba... 200\n", a.string
+    assert_equal "barbaz\n", b.string
+  end
+
+  def test_outputs_wrap_body
+    a, b = StringIO.new, StringIO.new
+    app = lambda { |env| [ 200, {}, [ 'hello' ] ] }
+    cl = Clogger.new(app, :reentrant => true, :outputs => [
+      { :logger => a, :format => '$body_bytes_sent' },
+      { :logger => b, :format => '$status', :max_line_length => 4 },
+    ])
+    body = cl.call(@req)[2]
+    body.each { |part| }
+    body.close
+    assert_equal "5\n", a.string
+    assert_equal "200\n", b.string
+  end
+
+  def test_outputs_invalid
+    app = lambda { |env| [ 200, {}, [] ] }
+    out = [ { :logger => StringIO.new } ]
+    assert_raise(ArgumentError) { Clogger.new(app, :outputs => []) }
+    assert_raise(ArgumentError) { Clogger.new(app, :outputs => [ 1 ]) }
+    assert_raise(ArgumentError) {
+      Clogger.new(app, :outputs => out, :logger => StringIO.new)
+    }
+    assert_raise(ArgumentError) {
+      Clogger.new(app, :outputs => [ { :outputs => out } ])
+    }
+  end
+
   def test_bogus_app_response
     str = StringIO.new
     app = lambda { |env| 302 }
@@ -704,6 +1211,418 @@ class TestClogger < Test::Unit::TestCase
     assert_equal "200\n", tmp.read
   end
 
+  def test_buffer
+    tmp = Tempfile.new('test_clogger')
+    app = lambda { |env| [ env['HTTP_X'].to_i, {}, [] ] }
+    cl = Clogger.new(app, :format => '$status', :path => tmp.path,
+                     :buffer => true, :flush_interval => 60)
+    before = cl.stats
+    %w(200 404 500).each { |x| cl.call(@req.merge('HTTP_X' => x)) }
+    assert_equal '', tmp.read
+    cl.flush
+    assert_equal "200\n404\n500\n", tmp.read
+    st = cl.stats
+    assert_equal 3, st[:lines] - before[:lines]
+    assert_equal 1, st[:write_calls] - before[:write_calls]
+    assert_equal 0, st[:logger_lines]
+  end
+
+  def test_buffer_limit
+    tmp = Tempfile.new('test_clogger')
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :format => '$status $body_bytes_sent',
+                     :path => tmp.path, :buffer => 12, :flush_interval => 60,
+                     :reentrant => true)
+    3.times { cl.call(@req)[2].close }
+    assert_equal "200 0\n200 0\n", tmp.read
+    cl.flush
+    assert_equal "200 0\n", tmp.read
+  end
+
+  def test_buffer_outputs
+    tmp = Tempfile.new('test_clogger')
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :outputs => [
+      { :format => '$status', :logger => str },
+      { :format => '$request_method', :path => tmp.path, :buffer => 4096 },
+    ])
+    cl.call(@req)
+    assert_equal "200\n", str.string
+    assert_equal '', tmp.read
+    cl.flush
+    assert_equal "GET\n", tmp.read
+  end
+
+  def test_buffer_invalid
+    tmp = Tempfile.new('test_clogger')
+    app = lambda { |env| [ 200, {}, [] ] }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => StringIO.new, :buffer => true)
+    }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :path => tmp.path, :buffer => 0)
+    }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :path => tmp.path, :buffer => true,
+                  :flush_interval => 0)
+    }
+  end
+
+  # just enough of a Fiber.scheduler to run fibers which never block
+  class StubScheduler
+    def fiber(&blk)
+      f = Fiber.new(:blocking => false, &blk)
+      f.resume
+      f
+    end
+
+    def io_wait(io, events, timeout)
+      events
+    end
+
+    def block(blocker, timeout = nil)
+      raise "unexpected block on #{blocker.inspect}"
+    end
+
+    def unblock(blocker, fiber)
+    end
+
+    def kernel_sleep(*args)
+    end
+
+    def close
+    end
+  end
+
+  def test_fiber_scheduler
+    defined?(Fiber.set_scheduler) or return # Ruby < 3.0
+    tmp = Tempfile.new('test_clogger')
+    app = lambda { |env| [ env['HTTP_X'].to_i, {}, [] ] }
+    cl = Clogger.new(app, :format => '$status', :path => tmp.path,
+                     :flush_interval => 60)
+    cl.call(@req.merge('HTTP_X' => '201'))
+    assert_equal "201\n", tmp.read
+    Thread.new do
+      Fiber.set_scheduler(StubScheduler.new)
+      Fiber.schedule { cl.call(@req.merge('HTTP_X' => '202')) }
+      Fiber.set_scheduler(nil)
+    end.join
+    assert_equal '', tmp.read
+
+    # stays behind the line logged from the fiber
+    cl.call(@req.merge('HTTP_X' => '203'))
+    assert_equal '', tmp.read
+    cl.flush
+    assert_equal "202\n203\n", tmp.read
+    cl.call(@req.merge('HTTP_X' => '204'))
+    assert_equal "204\n", tmp.read
+    assert_equal 4, cl.stats[:lines]
+  end
+
+  def test_reopen
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/log"
+      app = lambda { |env| [ 200, {}, [ 'hi' ] ] }
+      cl = Clogger.new(app, :format => '$body_bytes_sent', :path => path,
+                       :reentrant => true)
+      body = cl.call(@req)[2]
+      File.rename(path, "#{path}.old")
+      Clogger.reopen_all
+      body.each { |x| }
+      body.close # the reentrant copy moved on, too
+      cl.call(@req)[2].close
+      assert_equal '', File.read("#{path}.old")
+      assert_equal "2\n0\n", File.read(path)
+    end
+  end
+
+  def test_rotate_size
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/log"
+      app = lambda { |env| [ 200, {}, [] ] }
+      cl = Clogger.new(app, :format => '$status', :path => path,
+                       :rotate_size => 8)
+      2.times { cl.call(@req) }
+      rotated = nil
+      100.times do
+        rotated = Dir["#{path}.*"] and rotated.size == 1 and break
+        sleep 0.01
+      end
+      assert_equal 1, rotated.size
+      assert_equal "200\n200\n", File.read(rotated[0])
+      cl.call(@req)
+      assert_equal "200\n", File.read(path)
+    end
+  end
+
+  def test_rotate_shared
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/log"
+      app = lambda { |env| [ 200, {}, [] ] }
+      # stand-ins for two preforked workers sharing :path
+      a = Clogger.new(app, :format => '$status', :path => path,
+                      :rotate_size => 8)
+      b = Clogger.new(app, :format => '$status', :path => path,
+                      :rotate_size => 8)
+      b.call(@req)
+      2.times { a.call(@req) }
+      rotated = nil
+      100.times do
+        rotated = Dir["#{path}.*"] and rotated.size == 1 and break
+        sleep 0.01
+      end
+      assert_equal 1, rotated.size
+
+      # b follows the rename instead of rotating a's fresh file away
+      b.rotate
+      assert_equal rotated, Dir["#{path}.*"]
+      b.call(@req)
+      assert_equal "200\n200\n200\n", File.read(rotated[0])
+      assert_equal "200\n", File.read(path)
+    end
+  end
+
+  def test_rotate_invalid
+    tmp = Tempfile.new('test_clogger')
+    app = lambda { |env| [ 200, {}, [] ] }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => tmp, :rotate_size => 1)
+    }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :path => tmp.path, :rotate_interval => 0)
+    }
+  end
+
+  def test_escape_utf8
+    ua = "caf\xC3\xA9 \xF0\x9F\x98\x80 \"\x01\xC3 \xC2\x85 " \
+         "\xED\xA0\x80 \xC0\xAF \xE2\x82".b
+    xs = "caf\xC3\xA9 \xF0\x9F\x98\x80 \\x22\\x01\\xC3 \\xC2\\x85 " \
+         "\\xED\\xA0\\x80 \\xC0\\xAF \\xE2\\x82".b
+    app = lambda { |env| [ 200, {}, [] ] }
+    req = @req.merge('HTTP_USER_AGENT' => ua)
+    [ false, true ].each do |snapshot|
+      str = StringIO.new
+      cl = Clogger.new(app, :logger => str, :escape => :utf8,
+                       :format => '$http_user_agent', :snapshot => snapshot)
+      cl.call(req)
+      assert_equal "#{xs}\n", str.string.b
+
+      # never cut a character in half
+      str = StringIO.new
+      cl = Clogger.new(app, :logger => str, :escape => :utf8,
+                       :format => '$http_user_agent{6}|$http_user_agent{9}',
+                       :snapshot => snapshot)
+      cl.call(req)
+      assert_equal "caf...|caf\xC3\xA9 ...\n".b, str.string.b
+
+      str = StringIO.new
+      cl = Clogger.new(app, :logger => str, :escape => :utf8,
+                       :format => '<$http_user_agent>', :max_line_length => 9,
+                       :snapshot => snapshot)
+      cl.call(req)
+      assert_equal "<caf...\n", str.string.b
+    end
+
+    str = StringIO.new
+    cl = Clogger.new(app, :logger => str, :escape => :bytes,
+                     :format => '$http_user_agent{14}')
+    cl.call(req)
+    assert_equal "caf\\xC3\\xA9...\n", str.string
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => str, :escape => :latin1)
+    }
+  end
+
+  def test_snapshot
+    Dir.mktmpdir do |dir|
+      app = lambda { |env| [ 200, { 'X-Resp' => "a\"b\x01" }, [ 'hi' ] ] }
+      fmt = '$remote_addr "$request" $status $body_bytes_sent ' \
+            '$http_user_agent{7} $sent_http_x_resp $cookie_c $arg_a ' \
+            '$time_utc{%Y} [$time_iso8601] $e{1 + 1} $pid'
+      req = @req.merge('HTTP_USER_AGENT' => "\x00\x01\x02abc",
+                       'HTTP_COOKIE' => 'c=x%22y', 'QUERY_STRING' => 'a=b')
+      [ {}, { :max_line_length => 40 }, { :buffer => true },
+        { :index => true } ].each_with_index do |extra, i|
+        lines = [ false, true ].map do |snapshot|
+          path = "#{dir}/#{i}.#{snapshot}"
+          cl = Clogger.new(app, { :format => fmt, :path => path,
+                                  :snapshot => snapshot }.merge(extra))
+          body = cl.call(req)[2]
+          body.each { |x| }
+          body.close
+          cl.flush
+          File.read(path)
+        end
+        assert_equal lines[0], lines[1], extra.inspect
+      end
+      s = []
+      cl = Clogger.new(app, :logger => s, :format => fmt, :snapshot => true)
+      cl.call(req)[2].close
+      assert_match %r{\Ahome "GET /hello\?a=b HTTP/1\.0" 200 0 }, s[0]
+      assert_match %r{ \\x00\.\.\. a\\x22b\\x01 x\\x22y b \d{4} \[}, s[0]
+      assert_equal 1, cl.stats[:lines]
+    end
+    app = lambda { |env| [ 200, {}, [] ] }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => [], :snapshot => true, :dedup => [ '/' ])
+    }
+  end
+
+  def test_index
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/log"
+      File.write(path, "old\nold\n")
+      app = lambda { |env| [ 200, {}, [] ] }
+      cl = Clogger.new(app, :format => '$status', :path => path,
+                       :index => true)
+      3.times { cl.call(@req) }
+      sec, off, lines = File.binread("#{path}.idx").unpack('q<3')
+      assert_equal [ 8, 2 ], [ off, lines ]
+      idx = Clogger::Index.new(path)
+      assert_equal 8...20, idx.byte_range(Time.at(sec), sec + 5)
+      assert_equal 2...5, idx.line_range(sec, sec + 5)
+      assert_equal [ "200\n" ] * 3, idx.each_line(sec, sec + 5).to_a
+      assert_equal 20...20, idx.byte_range(sec + 5, sec + 10)
+
+      cl.reopen
+      cl.call(@req)
+      recs = File.binread("#{path}.idx").unpack('q<*').each_slice(3).to_a
+      assert_equal [ 20, 5 ], recs[-1][1, 2]
+
+      cl.rotate
+      assert_equal 1, Dir["#{path}.*.idx"].size
+      cl.call(@req)
+      assert_equal [ 0, 0 ], File.binread("#{path}.idx").unpack('q<3')[1, 2]
+    end
+  end
+
+  def test_flight_recorder
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/fr"
+      app = lambda { |env| [ env['PATH_INFO'] == '/3' ? 404 : 200, {}, [] ] }
+      fr_opt = { :path => path, :entries => 4 }
+      cl = Clogger.new(app, :logger => StringIO.new, :format => '$status $path_info',
+                       :flight_recorder => fr_opt)
+      t0 = Time.now.to_f
+      6.times { |i| cl.call(@req.merge('PATH_INFO' => "/#{i}")) }
+      fr = Clogger::FlightRecorder.new(path)
+      assert_equal 4, fr.entries
+      assert_equal 6, fr.head
+      recs = fr.to_a
+      assert_equal [ 2, 3, 4, 5 ], recs.map(&:seq)
+      assert_equal [ '200 /2', '404 /3', '200 /4', '200 /5' ], recs.map(&:line)
+      assert_equal [ 200, 404, 200, 200 ], recs.map(&:status)
+      assert_equal [ $$ ], recs.map(&:pid).uniq
+      recs.each do |r|
+        assert_operator r.time, :>=, t0 - 1
+        assert_operator r.time, :<=, Time.now.to_f + 1
+        assert_operator r.request_time, :>=, 0
+        assert_operator r.request_time, :<, 10
+      end
+      assert_equal [ 4, 5 ], fr.each(4).map(&:seq)
+
+      # a slot still being written is skipped
+      File.open(path, 'r+b') do |fp|
+        off = Clogger::FlightRecorder::HEADER_SIZE +
+              (5 % 4) * Clogger::FlightRecorder::SLOT_SIZE
+        fp.pwrite([ 5 * 2 + 1 ].pack('Q'), off)
+      end
+      assert_equal [ 2, 3, 4 ], fr.map(&:seq)
+      fr.close
+
+      # long lines are cut, the same layout is reused
+      cl = Clogger.new(app, :logger => StringIO.new, :format => '$path_info',
+                       :flight_recorder => fr_opt)
+      cl.call(@req.merge('PATH_INFO' => '/' * 1000))
+      fr = Clogger::FlightRecorder.new(path)
+      assert_equal 7, fr.head
+      assert_equal '/' * Clogger::FlightRecorder::LINE_MAX, fr.to_a[-1].line
+      fr.close
+
+      # a different layout starts over
+      Clogger.new(app, :logger => StringIO.new,
+                  :flight_recorder => fr_opt.merge(:entries => 8))
+      fr = Clogger::FlightRecorder.new(path)
+      assert_equal [ 8, 0, [] ], [ fr.entries, fr.head, fr.to_a ]
+      fr.close
+
+      [ { :entries => 4 }, fr_opt.merge(:entries => 0), path ].each do |bad|
+        assert_raises(ArgumentError) {
+          Clogger.new(app, :logger => StringIO.new, :flight_recorder => bad)
+        }
+      end
+      assert_raises(ArgumentError) {
+        Clogger.new(app, :flight_recorder => fr_opt,
+                    :outputs => [ { :logger => StringIO.new } ])
+      }
+
+      # ...it goes in one of the :outputs instead
+      cl = Clogger.new(app, :outputs => [
+        { :logger => StringIO.new, :format => '$status' },
+        { :logger => StringIO.new, :format => '$path_info',
+          :flight_recorder => fr_opt.merge(:entries => 8) } ])
+      cl.call(@req.merge('PATH_INFO' => '/o'))
+      fr = Clogger::FlightRecorder.new(path)
+      assert_equal [ '/o' ], fr.map(&:line)
+      fr.close
+    end
+  end
+
+  def test_index_invalid
+    app = lambda { |env| [ 200, {}, [] ] }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => StringIO.new, :index => true)
+    }
+  end
+
+  def test_dedup
+    str = StringIO.new
+    app = lambda { |env| [ env['HTTP_X'].to_i, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :dedup => { '/health' => 60 },
+                     :format => '$path_info $status $repeat_count $msec')
+    req = lambda { |path, status|
+      cl.call(@req.merge('PATH_INFO' => path, 'HTTP_X' => status))
+    }
+    req.call('/health', '200')
+    3.times { req.call('/health', '200') }
+    req.call('/health', '503')
+    req.call('/other', '200')
+    req.call('/health', '503')
+    cl.flush
+    lines = str.string.split(/\n/).map { |l| l.sub(/ \d+\.\d+\z/, '') }
+    expect = [ '/health 200 1', '/health 200 3', '/health 503 1',
+               '/other 200 1', '/health 503 1' ]
+    assert_equal expect, lines
+    assert_equal 4, cl.stats[:suppressed]
+  end
+
+  def test_dedup_window
+    str = StringIO.new
+    app = lambda { |env| [ 200, {}, [] ] }
+    cl = Clogger.new(app, :logger => str, :dedup => { '/' => 0.05 },
+                     :format => '$status $repeat_count')
+    3.times { cl.call(@req) }
+    cl.flush(false)
+    assert_equal "200 1\n", str.string
+    sleep 0.1
+    cl.flush(false)
+    assert_equal "200 1\n200 2\n", str.string
+    cl.call(@req)
+    assert_equal "200 1\n200 2\n200 1\n", str.string
+  end
+
+  def test_dedup_invalid
+    app = lambda { |env| [ 200, {}, [] ] }
+    assert_raises(ArgumentError) { Clogger.new(app, :dedup => true) }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => StringIO.new, :dedup => { '/' => 0 })
+    }
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => StringIO.new, :dedup => [])
+    }
+  end
+
   def test_path_logger_conflict
     tmp = Tempfile.new('test_clogger')
     app = lambda { |env| [ 200, {}, [] ] }
@@ -722,6 +1641,34 @@ class TestClogger < Test::Unit::TestCase
     assert s[-1].to_f <= 0.110
   end
 
+  def test_clock
+    s = []
+    app = lambda { |env| [ 200, [], [] ] }
+    cl = Clogger.new(app, :logger => s, :format => '$request_time{6}')
+    assert_equal :precise, cl.clock
+    cl = Clogger.new(app, :logger => s, :format => '$status $request_time{6}',
+                     :clock => :precise)
+    assert_equal :precise, cl.clock
+    cl = Clogger.new(app, :logger => s, :format => '$request_time{0} $time{0}')
+    assert_equal :precise, cl.clock
+    cl = Clogger.new(app, :logger => s, :format => '$request_time{0} $time{0}',
+                     :clock => :auto)
+    coarse = cl.__send__(:coarse_resolution) ? :coarse : :precise
+    assert_equal coarse, cl.clock
+    cl.call(@req)[2].close
+    assert_match %r{\A0 \d+\n\z}, s[-1]
+    assert_in_delta Time.now.to_i, s[-1].split[1].to_i, 2
+    if coarse == :coarse
+      cl = Clogger.new(app, :logger => s, :format => '$time{0}',
+                       :clock => :coarse)
+      assert_equal :coarse, cl.clock
+    end
+    assert_raises(ArgumentError) {
+      Clogger.new(app, :logger => s, :format => '$time{6}', :clock => :coarse)
+    }
+    assert_raises(ArgumentError) { Clogger.new(app, :clock => :fast) }
+  end
+
   def test_insanely_long_time_format
     s = []
     app = lambda { |env| [200, [], [] ] }
@@ -856,4 +1803,52 @@ class TestClogger < Test::Unit::TestCase
     body.close # might raise here
     assert_match(%r{GET /hello}, err.string)
   end
+
+  def test_parser_round_trip
+    str = StringIO.new
+    app = lambda { |env| [ 302, { 'Content-Length' => '3' }, [ 'abc' ] ] }
+    fmt = '$remote_addr "$request" $status $response_length "$http_user_agent"'
+    cl = Clogger.new(app, :logger => str, :format => fmt)
+    req = @req.merge('HTTP_USER_AGENT' => 'a "quoted" agent')
+    status, headers, body = cl.call(req)
+    body.each { |part| }
+    body.close
+    parser = Clogger::Parser.new(fmt)
+    fields = parser.parse_line(str.string)
+    assert_equal [ 'home', 'GET /hello?goodbye=true HTTP/1.0', '302', '3',
+                   'a \\x22quoted\\x22 agent' ], fields
+    assert_equal 'a "quoted" agent', Clogger::Parser.unescape(fields[4])
+    assert_nil parser.parse_line("garbage\n")
+    assert_equal fields, parser.parse_line(str.string) # cached layout
+    assert_equal fields, parser.dup.freeze.parse_line(str.string)
+    assert_equal %w($remote_addr $remote_user $time_local $request $status
+                    $response_length $http_referer $http_user_agent),
+                 Clogger::Parser.new(:Combined).fields
+  end
+
+  def test_parser_each_and_tally
+    tmp = Tempfile.new('clogger_parser')
+    lines = 3000.times.map { |i| "#{i} #{%w(200 404 503)[i % 3]} /x y\n" }
+    tmp.write(lines.join * 100)
+    tmp.write("this line does not fit\n")
+    tmp.flush
+    parser = Clogger::Parser.new('$pid $status $path_info y')
+    n = 0
+    parser.each(tmp.path) { |fields| n += 1 }
+    assert_equal 300000, n
+    assert_equal [ %w(0 200 /x) ], parser.each(tmp.path).first(1)
+    expect = { '200' => 100000, '404' => 100000, '503' => 100000 }
+    assert_equal expect, parser.tally(tmp.path, '$status')
+    assert_equal expect, parser.tally(tmp.path, 1, 1)
+    assert_equal 3000, parser.tally(tmp.path, '$pid', 4).size
+    assert_raises(ArgumentError) { parser.tally(tmp.path, '$request') }
+  ensure
+    tmp.close!
+  end
+
+  def test_parser_invalid
+    assert_raises(ArgumentError) { Clogger::Parser.new('$status$pid') }
+    assert_raises(ArgumentError) { Clogger::Parser.new("$status\n$pid") }
+    assert_equal [ '' ], Clogger::Parser.new('[$status]').parse_line('[]')
+  end
 end
@@ -0,0 +1,33 @@
+# -*- encoding: binary -*-
+$stderr.sync = $stdout.sync = true
+require "test/unit"
+require "rack"
+require "clogger"
+
+# verifies the optional sys/sdt.h probes made it into the built extension
+class TestCloggerUSDT < Test::Unit::TestCase
+  PROBES = %w(request__start app__return body__first
+              format__start format__done write__done)
+
+  def setup
+    @so = $LOADED_FEATURES.grep(%r{/clogger_ext\.[^/]+\z}).first or
+      omit "C extension not loaded"
+    system("readelf", "--version", :out => File::NULL) or
+      omit "readelf(1) not available"
+    makefile = File.join(File.dirname(@so), "Makefile")
+    sdt = if File.readable?(makefile)
+      File.read(makefile).include?("-DHAVE_SYS_SDT_H")
+    else
+      File.exist?("/usr/include/sys/sdt.h")
+    end
+    sdt or omit "built without sys/sdt.h"
+  end
+
+  def test_probes_present
+    notes = IO.popen([ "readelf", "-n", @so ], &:read)
+    assert $?.success?, "readelf -n #{@so} failed"
+    PROBES.each do |name|
+      assert_match %r{Provider: clogger\s+Name: #{name}\b}, notes
+    end
+  end
+end